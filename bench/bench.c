@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/allocator.h"
+#include "bench.h"
+
+const allocator_ops_t heap_allocator_ops = {
+    "heap", allocate, free_memory, reallocate, allocate_zeroed,
+    allocate_aligned};
+
+const allocator_ops_t glibc_ops = {"glibc", malloc, free, realloc, calloc,
+                                   memalign};
+
+// Only ever touched by the forked child running a benchmark
+int64_t shared_live_bytes = 0;
+int64_t shared_peak_live_bytes = 0;
+
+uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+size_t current_rss() {
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (!statm) {
+    return 0;
+  }
+  size_t total_pages = 0, resident_pages = 0;
+  if (fscanf(statm, "%zu %zu", &total_pages, &resident_pages) != 2) {
+    resident_pages = 0;
+  }
+  fclose(statm);
+  return resident_pages * sysconf(_SC_PAGESIZE);
+}
+
+void bench_threads_init(bench_thread_t *threads, int thread_count,
+                        const allocator_ops_t *ops) {
+  for (int i = 0; i < thread_count; ++i) {
+    threads[i].ops = ops;
+    threads[i].op_count = 0;
+    threads[i].latency_count = 0;
+    threads[i].live_bytes = 0;
+    threads[i].published_live_bytes = 0;
+    threads[i].seed = 0x9e3779b9u * (i + 1);
+    threads[i].index = i;
+  }
+}
+
+void publish_live_bytes(bench_thread_t *thread) {
+  int64_t delta = thread->live_bytes - thread->published_live_bytes;
+  thread->published_live_bytes = thread->live_bytes;
+  int64_t live_bytes =
+      __atomic_add_fetch(&shared_live_bytes, delta, __ATOMIC_RELAXED);
+  int64_t peak = __atomic_load_n(&shared_peak_live_bytes, __ATOMIC_RELAXED);
+  while (live_bytes > peak &&
+         !__atomic_compare_exchange_n(&shared_peak_live_bytes, &peak,
+                                      live_bytes, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+  }
+}
+
+// Returns the start time of a sampled operation, 0 otherwise
+uint64_t begin_operation(bench_thread_t *thread) {
+  if (thread->op_count++ % LATENCY_SAMPLE_INTERVAL != 0) {
+    return 0;
+  }
+  publish_live_bytes(thread);
+  return now_ns();
+}
+
+void end_operation(bench_thread_t *thread, uint64_t start) {
+  if (start && thread->latency_count < LATENCY_SAMPLES_PER_THREAD) {
+    thread->latencies[thread->latency_count++] = now_ns() - start;
+  }
+}
+
+void check_allocation(bench_thread_t *thread, void *ptr, size_t size) {
+  if (!ptr) {
+    fprintf(stderr, "%s: allocating %zu bytes failed\n", thread->ops->name,
+            size);
+    _exit(1);
+  }
+  thread->live_bytes += size;
+}
+
+void *bench_allocate(bench_thread_t *thread, size_t size) {
+  uint64_t start = begin_operation(thread);
+  void *ptr = thread->ops->allocate(size);
+  end_operation(thread, start);
+  check_allocation(thread, ptr, size);
+  return ptr;
+}
+
+void *bench_allocate_zeroed(bench_thread_t *thread, size_t size) {
+  uint64_t start = begin_operation(thread);
+  void *ptr = thread->ops->allocate_zeroed(1, size);
+  end_operation(thread, start);
+  check_allocation(thread, ptr, size);
+  return ptr;
+}
+
+void *bench_allocate_aligned(bench_thread_t *thread, size_t alignment,
+                             size_t size) {
+  uint64_t start = begin_operation(thread);
+  void *ptr = thread->ops->allocate_aligned(alignment, size);
+  end_operation(thread, start);
+  check_allocation(thread, ptr, size);
+  return ptr;
+}
+
+void bench_free(bench_thread_t *thread, void *ptr, size_t size) {
+  uint64_t start = begin_operation(thread);
+  thread->ops->free(ptr);
+  end_operation(thread, start);
+  thread->live_bytes -= size;
+}
+
+void *bench_reallocate(bench_thread_t *thread, void *ptr, size_t old_size,
+                       size_t size) {
+  uint64_t start = begin_operation(thread);
+  void *new_ptr = thread->ops->reallocate(ptr, size);
+  end_operation(thread, start);
+  if (!new_ptr) {
+    fprintf(stderr, "%s: reallocating to %zu bytes failed\n",
+            thread->ops->name, size);
+    _exit(1);
+  }
+  thread->live_bytes += (int64_t)size - (int64_t)old_size;
+  return new_ptr;
+}
+
+void touch_memory(void *ptr, size_t size) {
+  unsigned char *bytes = ptr;
+  for (size_t offset = 0; offset < size; offset += BENCH_PAGE) {
+    bytes[offset] = (unsigned char)offset;
+  }
+  bytes[size - 1] = (unsigned char)size;
+}
+
+int compare_latencies(const void *first, const void *second) {
+  uint64_t first_latency = *(const uint64_t *)first;
+  uint64_t second_latency = *(const uint64_t *)second;
+  return (first_latency > second_latency) - (first_latency < second_latency);
+}
+
+uint64_t get_percentile(uint64_t *sorted, size_t count, double percentile) {
+  return count ? sorted[(size_t)((count - 1) * percentile)] : 0;
+}
+
+/* The latency buffers are mapped before the baseline is taken, but only the
+ * samples written during the run become resident, so their size is reported
+ * for the parent to subtract.
+ */
+void run_benchmark_child(bench_workload_t workload, size_t parameter,
+                         const allocator_ops_t *ops, int thread_count,
+                         bench_result_t *result) {
+  bench_thread_t threads[BENCH_MAX_THREADS];
+  size_t buffer_size =
+      thread_count * LATENCY_SAMPLES_PER_THREAD * sizeof(uint64_t);
+  uint64_t *latencies = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (latencies == MAP_FAILED) {
+    _exit(1);
+  }
+  bench_threads_init(threads, thread_count, ops);
+  for (int i = 0; i < thread_count; ++i) {
+    threads[i].latencies = latencies + i * LATENCY_SAMPLES_PER_THREAD;
+  }
+
+  result->baseline_rss = current_rss();
+  uint64_t start = now_ns();
+  workload(threads, thread_count, parameter);
+  result->seconds = (now_ns() - start) / 1e9;
+
+  size_t sample_count = 0;
+  result->ops = 0;
+  for (int i = 0; i < thread_count; ++i) {
+    publish_live_bytes(&threads[i]);
+    result->ops += threads[i].op_count;
+    memmove(latencies + sample_count, threads[i].latencies,
+            threads[i].latency_count * sizeof(uint64_t));
+    sample_count += threads[i].latency_count;
+  }
+  result->sample_bytes = sample_count * sizeof(uint64_t);
+  qsort(latencies, sample_count, sizeof(uint64_t), compare_latencies);
+  result->p50 = get_percentile(latencies, sample_count, 0.5);
+  result->p99 = get_percentile(latencies, sample_count, 0.99);
+  result->p999 = get_percentile(latencies, sample_count, 0.999);
+  result->peak_live_bytes = shared_peak_live_bytes;
+}
+
+int run_benchmark(bench_workload_t workload, size_t parameter,
+                  const allocator_ops_t *ops, int thread_count,
+                  bench_result_t *result) {
+  bench_result_t *shared_result =
+      mmap(NULL, sizeof(bench_result_t), PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared_result == MAP_FAILED) {
+    return 0;
+  }
+  memset(shared_result, 0, sizeof(bench_result_t));
+  fflush(stdout);
+  pid_t child = fork();
+  if (child == 0) {
+    run_benchmark_child(workload, parameter, ops, thread_count,
+                        shared_result);
+    _exit(0);
+  }
+
+  int status = 0;
+  struct rusage usage;
+  memset(&usage, 0, sizeof(usage));
+  int waited = child > 0 && wait4(child, &status, 0, &usage) == child;
+  *result = *shared_result;
+  munmap(shared_result, sizeof(bench_result_t));
+  result->peak_rss = (size_t)usage.ru_maxrss * 1024;
+  result->failed =
+      !waited || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  return !result->failed;
+}
+
+void print_result_header() {
+  printf("%-22s %-6s %12s %8s %8s %9s %12s %6s\n", "benchmark", "alloc",
+         "ops/s", "p50 ns", "p99 ns", "p999 ns", "peak RSS KiB", "frag");
+}
+
+/* Fragmentation is the memory the run added to the resident set over the
+ * peak of requested bytes alive at once, 1.00 being no overhead at all. Live
+ * sets smaller than a few pages say nothing, so they're left out.
+ */
+void print_result(const char *benchmark, const char *allocator,
+                  const bench_result_t *result) {
+  if (result->failed) {
+    printf("%-22s %-6s %12s\n", benchmark, allocator, "failed");
+    return;
+  }
+  size_t overhead = result->baseline_rss + result->sample_bytes;
+  size_t used_rss =
+      result->peak_rss > overhead ? result->peak_rss - overhead : 0;
+  double ops_per_second =
+      result->seconds > 0 ? result->ops / result->seconds : 0;
+  printf("%-22s %-6s %12.0f %8lu %8lu %9lu %12zu ", benchmark, allocator,
+         ops_per_second, (unsigned long)result->p50,
+         (unsigned long)result->p99, (unsigned long)result->p999,
+         result->peak_rss / 1024);
+  if (result->peak_live_bytes >= FRAGMENTATION_MIN_LIVE_BYTES) {
+    printf("%6.2f\n", (double)used_rss / result->peak_live_bytes);
+  } else {
+    printf("%6s\n", "-");
+  }
+}
@@ -0,0 +1,109 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Every LATENCY_SAMPLE_INTERVAL-th operation of a thread gets timed
+#define LATENCY_SAMPLE_INTERVAL 16u
+#define LATENCY_SAMPLES_PER_THREAD (1u << 20)
+#define BENCH_MAX_THREADS 64
+#define BENCH_PAGE 4096u
+#define FRAGMENTATION_MIN_LIVE_BYTES (64u * 1024)
+
+// The allocators being compared, called through the same entry points
+typedef struct allocator_ops_t {
+  const char *name;
+  void *(*allocate)(size_t size);
+  void (*free)(void *ptr);
+  void *(*reallocate)(void *ptr, size_t size);
+  void *(*allocate_zeroed)(size_t count, size_t size);
+  void *(*allocate_aligned)(size_t alignment, size_t size);
+} allocator_ops_t;
+
+// Per-thread bookkeeping. Live bytes are the requested sizes, they're only
+// published to the shared peak at sampled operations.
+typedef struct bench_thread_t {
+  const allocator_ops_t *ops;
+  uint64_t op_count;
+  uint64_t *latencies;
+  size_t latency_count;
+  int64_t live_bytes;
+  int64_t published_live_bytes;
+  unsigned int seed;
+  int index;
+} bench_thread_t;
+
+// Written by the forked child running the benchmark, read by the parent
+typedef struct bench_result_t {
+  double seconds;
+  uint64_t ops;
+  uint64_t p50;
+  uint64_t p99;
+  uint64_t p999;
+  size_t peak_live_bytes;
+  size_t baseline_rss;
+  size_t sample_bytes;
+  size_t peak_rss;
+  int failed;
+} bench_result_t;
+
+typedef void (*bench_workload_t)(bench_thread_t *threads, int thread_count,
+                                 size_t parameter);
+
+extern const allocator_ops_t heap_allocator_ops;
+
+extern const allocator_ops_t glibc_ops;
+
+uint64_t now_ns();
+
+// Resident set of the process in bytes
+size_t current_rss();
+
+void bench_threads_init(bench_thread_t *threads, int thread_count,
+                        const allocator_ops_t *ops);
+
+void publish_live_bytes(bench_thread_t *thread);
+
+uint64_t begin_operation(bench_thread_t *thread);
+
+void end_operation(bench_thread_t *thread, uint64_t start);
+
+// Out of memory ends the benchmark, the parent sees the failed child
+void check_allocation(bench_thread_t *thread, void *ptr, size_t size);
+
+void *bench_allocate(bench_thread_t *thread, size_t size);
+
+void *bench_allocate_zeroed(bench_thread_t *thread, size_t size);
+
+void *bench_allocate_aligned(bench_thread_t *thread, size_t alignment,
+                             size_t size);
+
+void bench_free(bench_thread_t *thread, void *ptr, size_t size);
+
+void *bench_reallocate(bench_thread_t *thread, void *ptr, size_t old_size,
+                       size_t size);
+
+// Writes one byte per page, so that the object counts as resident
+void touch_memory(void *ptr, size_t size);
+
+int compare_latencies(const void *first, const void *second);
+
+uint64_t get_percentile(uint64_t *sorted, size_t count, double percentile);
+
+void run_benchmark_child(bench_workload_t workload, size_t parameter,
+                         const allocator_ops_t *ops, int thread_count,
+                         bench_result_t *result);
+
+// Runs the workload in a forked child, so every run starts from a fresh
+// heap and gets its own peak RSS. Returns 0 if the child failed.
+int run_benchmark(bench_workload_t workload, size_t parameter,
+                  const allocator_ops_t *ops, int thread_count,
+                  bench_result_t *result);
+
+void print_result_header();
+
+void print_result(const char *benchmark, const char *allocator,
+                  const bench_result_t *result);
+
+#endif
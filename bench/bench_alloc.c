@@ -0,0 +1,473 @@
+/* Allocator microbenchmarks. Every benchmark runs once on the allocator and
+ * once on glibc malloc, each run in its own forked child:
+ *
+ *   bench_alloc [-t threads] [-s scale] [benchmark prefix...]
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/allocator.h"
+#include "bench.h"
+
+#define DEFAULT_THREADS 4
+#define PAIR_ITERATIONS 1000000
+#define PAIR_LARGE_SIZES {512, 1024, 4096, 16384, 65536, 262144}
+#define PAIR_LARGE_SIZE_COUNT 6
+#define ORDER_OBJECTS 10000
+#define ORDER_ROUNDS 50
+#define ORDER_LIFO 0
+#define ORDER_FIFO 1
+#define ORDER_RANDOM 2
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 10
+#define LARSON_OPERATIONS 100000
+#define XMALLOC_OBJECTS 2000000
+#define XMALLOC_BATCH_SIZE 254
+#define XMALLOC_MAX_QUEUED 64
+#define SCRATCH_ITERATIONS 500000
+#define SCRATCH_WRITES 64
+#define MSTRESS_SLOTS 2000
+#define MSTRESS_ROUNDS 10
+#define MSTRESS_TRANSFER_SLOTS 256
+#define REALLOC_LIMIT (1024 * 1024)
+#define REALLOC_ROUNDS 20
+#define REALLOC_BLOCKER_INTERVAL 16
+#define MAX_BENCHMARKS 64
+
+typedef struct benchmark_t {
+  char name[32];
+  bench_workload_t workload;
+  size_t parameter;
+} benchmark_t;
+
+// Objects are handed between threads in batches in xmalloc-test
+typedef struct xmalloc_batch_t {
+  struct xmalloc_batch_t *next;
+  size_t count;
+  void *objects[XMALLOC_BATCH_SIZE];
+} xmalloc_batch_t;
+
+typedef struct xmalloc_queue_t {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  xmalloc_batch_t *head;
+  xmalloc_batch_t *tail;
+  size_t queued;
+  int producers_left;
+} xmalloc_queue_t;
+
+size_t bench_scale = 1;
+
+void *order_objects[ORDER_OBJECTS];
+size_t order_sizes[ORDER_OBJECTS];
+size_t order_permutation[ORDER_OBJECTS];
+
+void *larson_objects[BENCH_MAX_THREADS][LARSON_SLOTS];
+size_t larson_sizes[BENCH_MAX_THREADS][LARSON_SLOTS];
+
+xmalloc_queue_t xmalloc_queue = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                 .changed = PTHREAD_COND_INITIALIZER};
+int xmalloc_producer_count;
+
+void *scratch_objects[BENCH_MAX_THREADS];
+
+size_t *mstress_transfers[MSTRESS_TRANSFER_SLOTS];
+
+size_t random_size(bench_thread_t *thread, size_t min_size, size_t max_size) {
+  return min_size + rand_r(&thread->seed) % (max_size - min_size + 1);
+}
+
+void run_threads(bench_thread_t *threads, int thread_count,
+                 void *(*thread_main)(void *)) {
+  pthread_t thread_ids[BENCH_MAX_THREADS];
+  for (int i = 0; i < thread_count; ++i) {
+    pthread_create(&thread_ids[i], NULL, thread_main, &threads[i]);
+  }
+  for (int i = 0; i < thread_count; ++i) {
+    pthread_join(thread_ids[i], NULL);
+  }
+}
+
+// An allocation immediately freed again, one size at a time
+void bench_pairs(bench_thread_t *threads, int thread_count, size_t size) {
+  (void)thread_count;
+  bench_thread_t *thread = &threads[0];
+  for (size_t i = 0; i < PAIR_ITERATIONS * bench_scale; ++i) {
+    char *object = bench_allocate(thread, size);
+    *(volatile char *)object = 1;
+    bench_free(thread, object, size);
+  }
+}
+
+void bench_order(bench_thread_t *threads, int thread_count, size_t order) {
+  (void)thread_count;
+  bench_thread_t *thread = &threads[0];
+  for (size_t round = 0; round < ORDER_ROUNDS * bench_scale; ++round) {
+    for (size_t i = 0; i < ORDER_OBJECTS; ++i) {
+      order_sizes[i] = random_size(thread, 16, 512);
+      order_objects[i] = bench_allocate(thread, order_sizes[i]);
+      touch_memory(order_objects[i], order_sizes[i]);
+      order_permutation[i] = i;
+    }
+    for (size_t i = 0; i < ORDER_OBJECTS; ++i) {
+      size_t index = i;
+      if (order == ORDER_LIFO) {
+        index = ORDER_OBJECTS - 1 - i;
+      } else if (order == ORDER_RANDOM) {
+        size_t swap = i + rand_r(&thread->seed) % (ORDER_OBJECTS - i);
+        index = order_permutation[swap];
+        order_permutation[swap] = order_permutation[i];
+      }
+      bench_free(thread, order_objects[index], order_sizes[index]);
+    }
+  }
+}
+
+// Replaces random objects of its slots, which were allocated by whichever
+// thread owned them in the previous round
+void *larson_thread(void *thread_ptr) {
+  bench_thread_t *thread = thread_ptr;
+  void **objects = larson_objects[thread->index];
+  size_t *sizes = larson_sizes[thread->index];
+  for (size_t i = 0; i < LARSON_OPERATIONS; ++i) {
+    size_t slot = rand_r(&thread->seed) % LARSON_SLOTS;
+    bench_free(thread, objects[slot], sizes[slot]);
+    sizes[slot] = random_size(thread, 8, 1000);
+    objects[slot] = bench_allocate(thread, sizes[slot]);
+    *(volatile char *)objects[slot] = 1;
+  }
+  return NULL;
+}
+
+/* Larson server simulation: every round's threads exit and hand their slots
+ * to fresh threads, so objects keep outliving the threads allocating them.
+ */
+void bench_larson(bench_thread_t *threads, int thread_count,
+                  size_t parameter) {
+  (void)parameter;
+  for (int i = 0; i < thread_count; ++i) {
+    for (size_t slot = 0; slot < LARSON_SLOTS; ++slot) {
+      larson_sizes[i][slot] = random_size(&threads[0], 8, 1000);
+      larson_objects[i][slot] =
+          bench_allocate(&threads[0], larson_sizes[i][slot]);
+    }
+  }
+  for (size_t round = 0; round < LARSON_ROUNDS * bench_scale; ++round) {
+    run_threads(threads, thread_count, larson_thread);
+  }
+  for (int i = 0; i < thread_count; ++i) {
+    for (size_t slot = 0; slot < LARSON_SLOTS; ++slot) {
+      bench_free(&threads[0], larson_objects[i][slot], larson_sizes[i][slot]);
+    }
+  }
+}
+
+void push_xmalloc_batch(xmalloc_batch_t *batch) {
+  pthread_mutex_lock(&xmalloc_queue.lock);
+  while (xmalloc_queue.queued >= XMALLOC_MAX_QUEUED) {
+    pthread_cond_wait(&xmalloc_queue.changed, &xmalloc_queue.lock);
+  }
+  batch->next = NULL;
+  if (xmalloc_queue.tail) {
+    xmalloc_queue.tail->next = batch;
+  } else {
+    xmalloc_queue.head = batch;
+  }
+  xmalloc_queue.tail = batch;
+  xmalloc_queue.queued++;
+  pthread_cond_broadcast(&xmalloc_queue.changed);
+  pthread_mutex_unlock(&xmalloc_queue.lock);
+}
+
+// Returns NULL once the producers are done and the queue ran empty
+xmalloc_batch_t *pop_xmalloc_batch() {
+  pthread_mutex_lock(&xmalloc_queue.lock);
+  while (!xmalloc_queue.head && xmalloc_queue.producers_left) {
+    pthread_cond_wait(&xmalloc_queue.changed, &xmalloc_queue.lock);
+  }
+  xmalloc_batch_t *batch = xmalloc_queue.head;
+  if (batch) {
+    xmalloc_queue.head = batch->next;
+    if (!xmalloc_queue.head) {
+      xmalloc_queue.tail = NULL;
+    }
+    xmalloc_queue.queued--;
+    pthread_cond_broadcast(&xmalloc_queue.changed);
+  }
+  pthread_mutex_unlock(&xmalloc_queue.lock);
+  return batch;
+}
+
+// Objects store their size, so that the consumer can account for them
+void *xmalloc_thread(void *thread_ptr) {
+  bench_thread_t *thread = thread_ptr;
+  if (thread->index >= xmalloc_producer_count) {
+    xmalloc_batch_t *batch;
+    while ((batch = pop_xmalloc_batch())) {
+      for (size_t i = 0; i < batch->count; ++i) {
+        size_t *object = batch->objects[i];
+        bench_free(thread, object, *object);
+      }
+      bench_free(thread, batch, sizeof(xmalloc_batch_t));
+    }
+    return NULL;
+  }
+
+  size_t objects_left = XMALLOC_OBJECTS * bench_scale / xmalloc_producer_count;
+  while (objects_left) {
+    xmalloc_batch_t *batch = bench_allocate(thread, sizeof(xmalloc_batch_t));
+    batch->count = 0;
+    while (objects_left && batch->count < XMALLOC_BATCH_SIZE) {
+      size_t size = random_size(thread, sizeof(size_t), 128);
+      size_t *object = bench_allocate(thread, size);
+      *object = size;
+      batch->objects[batch->count++] = object;
+      objects_left--;
+    }
+    push_xmalloc_batch(batch);
+  }
+  pthread_mutex_lock(&xmalloc_queue.lock);
+  xmalloc_queue.producers_left--;
+  pthread_cond_broadcast(&xmalloc_queue.changed);
+  pthread_mutex_unlock(&xmalloc_queue.lock);
+  return NULL;
+}
+
+// xmalloc-test: half of the threads allocate, the other half frees
+void bench_xmalloc(bench_thread_t *threads, int thread_count,
+                   size_t parameter) {
+  (void)parameter;
+  xmalloc_producer_count = thread_count / 2;
+  xmalloc_queue.producers_left = xmalloc_producer_count;
+  run_threads(threads, thread_count, xmalloc_thread);
+}
+
+void *scratch_thread(void *thread_ptr) {
+  bench_thread_t *thread = thread_ptr;
+  bench_free(thread, scratch_objects[thread->index], 8);
+  for (size_t i = 0; i < SCRATCH_ITERATIONS * bench_scale; ++i) {
+    volatile char *object = bench_allocate(thread, 8);
+    for (int write = 0; write < SCRATCH_WRITES; ++write) {
+      object[write % 8]++;
+    }
+    bench_free(thread, (void *)object, 8);
+  }
+  return NULL;
+}
+
+/* cache-scratch: every thread frees one of the neighbouring objects the main
+ * thread allocated, then keeps allocating and writing objects of that size.
+ * An allocator passing the freed memory back shares cache lines between
+ * threads.
+ */
+void bench_cache_scratch(bench_thread_t *threads, int thread_count,
+                         size_t parameter) {
+  (void)parameter;
+  for (int i = 0; i < thread_count; ++i) {
+    scratch_objects[i] = bench_allocate(&threads[0], 8);
+  }
+  run_threads(threads, thread_count, scratch_thread);
+}
+
+// Mostly small objects, with the occasional large one
+size_t mstress_size(bench_thread_t *thread) {
+  unsigned int size_kind = rand_r(&thread->seed) % 100;
+  if (size_kind < 80) {
+    return random_size(thread, sizeof(size_t), 128);
+  }
+  if (size_kind < 98) {
+    return random_size(thread, 129, 4096);
+  }
+  return random_size(thread, 4097, 262144);
+}
+
+/* Objects start with their size. Occupied slots get freed, replaced or traded
+ * with a shared slot, so some objects are freed by other threads, and every
+ * round ends with half of the slots freed.
+ */
+void *mstress_thread(void *thread_ptr) {
+  bench_thread_t *thread = thread_ptr;
+  size_t *slots[MSTRESS_SLOTS] = {NULL};
+  for (size_t round = 0; round < MSTRESS_ROUNDS * bench_scale; ++round) {
+    for (size_t i = 0; i < 2 * MSTRESS_SLOTS; ++i) {
+      size_t slot = rand_r(&thread->seed) % MSTRESS_SLOTS;
+      unsigned int action = rand_r(&thread->seed) % 8;
+      if (slots[slot] && action == 0) {
+        slots[slot] = __atomic_exchange_n(
+            &mstress_transfers[rand_r(&thread->seed) % MSTRESS_TRANSFER_SLOTS],
+            slots[slot], __ATOMIC_ACQ_REL);
+        continue;
+      }
+      if (slots[slot]) {
+        bench_free(thread, slots[slot], *slots[slot]);
+        slots[slot] = NULL;
+      }
+      if (action < 6) {
+        size_t size = mstress_size(thread);
+        slots[slot] = bench_allocate(thread, size);
+        touch_memory(slots[slot], size);
+        *slots[slot] = size;
+      }
+    }
+    for (size_t slot = 0; slot < MSTRESS_SLOTS; slot += 2) {
+      if (slots[slot]) {
+        bench_free(thread, slots[slot], *slots[slot]);
+        slots[slot] = NULL;
+      }
+    }
+  }
+  for (size_t slot = 0; slot < MSTRESS_SLOTS; ++slot) {
+    if (slots[slot]) {
+      bench_free(thread, slots[slot], *slots[slot]);
+    }
+  }
+  return NULL;
+}
+
+void bench_mstress(bench_thread_t *threads, int thread_count,
+                   size_t parameter) {
+  (void)parameter;
+  run_threads(threads, thread_count, mstress_thread);
+  for (size_t slot = 0; slot < MSTRESS_TRANSFER_SLOTS; ++slot) {
+    if (mstress_transfers[slot]) {
+      bench_free(&threads[0], mstress_transfers[slot],
+                 *mstress_transfers[slot]);
+      mstress_transfers[slot] = NULL;
+    }
+  }
+}
+
+// A buffer growing in small steps, with small allocations in between that
+// get in the way of growing in place
+void bench_realloc(bench_thread_t *threads, int thread_count,
+                   size_t parameter) {
+  (void)thread_count;
+  (void)parameter;
+  bench_thread_t *thread = &threads[0];
+  void *blockers[REALLOC_LIMIT / 16 / REALLOC_BLOCKER_INTERVAL + 1];
+  for (size_t round = 0; round < REALLOC_ROUNDS * bench_scale; ++round) {
+    char *buffer = NULL;
+    size_t size = 0;
+    size_t blocker_count = 0;
+    for (size_t step = 0; size < REALLOC_LIMIT; ++step) {
+      size_t new_size = size + random_size(thread, 16, 256);
+      buffer = bench_reallocate(thread, buffer, size, new_size);
+      buffer[new_size - 1] = 1;
+      size = new_size;
+      if (step % REALLOC_BLOCKER_INTERVAL == 0) {
+        blockers[blocker_count++] = bench_allocate(thread, 32);
+      }
+    }
+    bench_free(thread, buffer, size);
+    for (size_t i = 0; i < blocker_count; ++i) {
+      bench_free(thread, blockers[i], 32);
+    }
+  }
+}
+
+void add_benchmark(benchmark_t *benchmarks, int *benchmark_count,
+                   const char *name, bench_workload_t workload,
+                   size_t parameter) {
+  benchmark_t *benchmark = &benchmarks[(*benchmark_count)++];
+  snprintf(benchmark->name, sizeof(benchmark->name), "%s", name);
+  benchmark->workload = workload;
+  benchmark->parameter = parameter;
+}
+
+// Pairs for every slab class and a few heap and mmap sizes
+int list_benchmarks(benchmark_t *benchmarks) {
+  int benchmark_count = 0;
+  size_t large_sizes[PAIR_LARGE_SIZE_COUNT] = PAIR_LARGE_SIZES;
+  char name[32];
+  for (int i = 0; i < SLAB_CLASS_COUNT; ++i) {
+    snprintf(name, sizeof(name), "pairs-%u", slab_class_sizes[i]);
+    add_benchmark(benchmarks, &benchmark_count, name, bench_pairs,
+                  slab_class_sizes[i]);
+  }
+  for (int i = 0; i < PAIR_LARGE_SIZE_COUNT; ++i) {
+    snprintf(name, sizeof(name), "pairs-%zu", large_sizes[i]);
+    add_benchmark(benchmarks, &benchmark_count, name, bench_pairs,
+                  large_sizes[i]);
+  }
+  add_benchmark(benchmarks, &benchmark_count, "order-lifo", bench_order,
+                ORDER_LIFO);
+  add_benchmark(benchmarks, &benchmark_count, "order-fifo", bench_order,
+                ORDER_FIFO);
+  add_benchmark(benchmarks, &benchmark_count, "order-random", bench_order,
+                ORDER_RANDOM);
+  add_benchmark(benchmarks, &benchmark_count, "larson", bench_larson, 0);
+  add_benchmark(benchmarks, &benchmark_count, "xmalloc-test", bench_xmalloc,
+                0);
+  add_benchmark(benchmarks, &benchmark_count, "cache-scratch",
+                bench_cache_scratch, 0);
+  add_benchmark(benchmarks, &benchmark_count, "mstress", bench_mstress, 0);
+  add_benchmark(benchmarks, &benchmark_count, "realloc-growth", bench_realloc,
+                0);
+  return benchmark_count;
+}
+
+int is_benchmark_selected(const char *name, char **prefixes,
+                          int prefix_count) {
+  if (prefix_count == 0) {
+    return 1;
+  }
+  for (int i = 0; i < prefix_count; ++i) {
+    if (strncmp(name, prefixes[i], strlen(prefixes[i])) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int thread_count = DEFAULT_THREADS;
+  int option;
+  while ((option = getopt(argc, argv, "t:s:")) != -1) {
+    switch (option) {
+    case 't':
+      thread_count = atoi(optarg);
+      break;
+    case 's':
+      bench_scale = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-t threads] [-s scale] [benchmark...]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  // xmalloc-test needs a producer and a consumer
+  if (thread_count < 2) {
+    thread_count = 2;
+  }
+  if (thread_count > BENCH_MAX_THREADS) {
+    thread_count = BENCH_MAX_THREADS;
+  }
+  if (bench_scale == 0) {
+    bench_scale = 1;
+  }
+
+  benchmark_t benchmarks[MAX_BENCHMARKS];
+  int benchmark_count = list_benchmarks(benchmarks);
+  const allocator_ops_t *allocators[] = {&heap_allocator_ops, &glibc_ops};
+  int failures = 0;
+  print_result_header();
+  for (int i = 0; i < benchmark_count; ++i) {
+    if (!is_benchmark_selected(benchmarks[i].name, argv + optind,
+                               argc - optind)) {
+      continue;
+    }
+    for (int j = 0; j < 2; ++j) {
+      bench_result_t result;
+      failures += !run_benchmark(benchmarks[i].workload,
+                                 benchmarks[i].parameter, allocators[j],
+                                 thread_count, &result);
+      print_result(benchmarks[i].name, allocators[j]->name, &result);
+    }
+  }
+  return failures != 0;
+}
@@ -0,0 +1,331 @@
+/* Replays traces recorded with trace_start(), or with HEAP_ALLOCATOR_TRACE set
+ * for the preloaded library, once on the allocator and once on glibc malloc:
+ *
+ *   replay_trace trace-file...
+ *
+ * The calls of all recorded threads are replayed by a single thread in the
+ * order they were recorded, which keeps every free after its allocation.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../src/allocator.h"
+#include "bench.h"
+
+#define REPLAY_ALLOCATE 1
+#define REPLAY_FREE 2
+#define REPLAY_ALLOCATE_ZEROED 3
+#define REPLAY_REALLOCATE 4
+#define REPLAY_ALLOCATE_ALIGNED 5
+// Addresses are aligned, so these never clash with recorded ones
+#define ADDRESS_EMPTY 0
+#define ADDRESS_REMOVED 1
+
+// A recorded call with its objects numbered, slots get reused once freed
+typedef struct replay_op_t {
+  uint64_t size;
+  uint64_t alignment;
+  uint32_t slot;
+  uint32_t op;
+} replay_op_t;
+
+// Open addressing from recorded addresses to slots
+typedef struct address_map_t {
+  uint64_t *addresses;
+  uint32_t *slots;
+  size_t mask;
+} address_map_t;
+
+size_t trace_record_count;
+replay_op_t *replay_ops;
+size_t replay_op_count;
+void **slot_objects;
+uint64_t *slot_sizes;
+
+uint32_t *free_slots;
+size_t free_slot_count;
+uint32_t slot_count;
+
+void *map_array(size_t count, size_t element_size) {
+  void *array = mmap(NULL, count * element_size + 1, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (array == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return array;
+}
+
+size_t hash_address(uint64_t address, size_t mask) {
+  return ((address >> 4) * 0x9e3779b97f4a7c15ull >> 20) & mask;
+}
+
+// Returns the cell holding the address, or the empty one ending its chain
+size_t find_address(address_map_t *map, uint64_t address) {
+  size_t cell = hash_address(address, map->mask);
+  while (map->addresses[cell] != ADDRESS_EMPTY &&
+         map->addresses[cell] != address) {
+    cell = (cell + 1) & map->mask;
+  }
+  return cell;
+}
+
+int lookup_address(address_map_t *map, uint64_t address, uint32_t *slot) {
+  if (address == ADDRESS_EMPTY) {
+    return 0;
+  }
+  size_t cell = find_address(map, address);
+  if (map->addresses[cell] != address) {
+    return 0;
+  }
+  *slot = map->slots[cell];
+  return 1;
+}
+
+void remove_address(address_map_t *map, uint64_t address) {
+  size_t cell = find_address(map, address);
+  if (map->addresses[cell] == address) {
+    map->addresses[cell] = ADDRESS_REMOVED;
+  }
+}
+
+// Every insert uses up at most one cell, and the map has twice as many cells
+// as there are records, so it never fills up
+void insert_address(address_map_t *map, uint64_t address, uint32_t slot) {
+  size_t cell = hash_address(address, map->mask);
+  while (map->addresses[cell] != ADDRESS_EMPTY &&
+         map->addresses[cell] != ADDRESS_REMOVED) {
+    cell = (cell + 1) & map->mask;
+  }
+  map->addresses[cell] = address;
+  map->slots[cell] = slot;
+}
+
+uint32_t take_slot() {
+  return free_slot_count ? free_slots[--free_slot_count] : slot_count++;
+}
+
+void add_replay_op(int op, uint32_t slot, uint64_t size, uint64_t alignment) {
+  replay_op_t *replay_op = &replay_ops[replay_op_count++];
+  replay_op->op = op;
+  replay_op->slot = slot;
+  replay_op->size = size;
+  replay_op->alignment = alignment;
+}
+
+void free_address(address_map_t *map, uint64_t address) {
+  uint32_t slot;
+  if (lookup_address(map, address, &slot)) {
+    add_replay_op(REPLAY_FREE, slot, 0, 0);
+    remove_address(map, address);
+    free_slots[free_slot_count++] = slot;
+  }
+}
+
+/* A realloc frees the old address before its record is written, so another
+ * thread may get the address recorded first. An allocation at a live address
+ * therefore ends the object that was there.
+ */
+void allocate_address(address_map_t *map, int op, uint64_t address,
+                      uint64_t size, uint64_t alignment) {
+  free_address(map, address);
+  uint32_t slot = take_slot();
+  insert_address(map, address, slot);
+  add_replay_op(op, slot, size, alignment);
+}
+
+// Frees of objects allocated before the oldest record are dropped, and
+// objects resized from before it are allocated instead
+void translate_record(address_map_t *map, trace_record_t *record) {
+  uint32_t slot;
+  switch (record->op) {
+  case TRACE_ALLOCATE:
+  case TRACE_ALLOCATE_ZEROED:
+    if (record->pointer) {
+      allocate_address(map,
+                       record->op == TRACE_ALLOCATE ? REPLAY_ALLOCATE
+                                                    : REPLAY_ALLOCATE_ZEROED,
+                       record->pointer, record->size, 0);
+    }
+    return;
+  case TRACE_ALLOCATE_ALIGNED:
+    if (record->pointer) {
+      allocate_address(map, REPLAY_ALLOCATE_ALIGNED, record->pointer,
+                       record->size, record->argument);
+    }
+    return;
+  case TRACE_FREE:
+    free_address(map, record->pointer);
+    return;
+  case TRACE_REALLOCATE:
+    if (!lookup_address(map, record->argument, &slot)) {
+      if (record->pointer) {
+        allocate_address(map, REPLAY_ALLOCATE, record->pointer, record->size,
+                         0);
+      }
+      return;
+    }
+    // A failed resize left the object alone
+    if (!record->pointer) {
+      if (record->size == 0) {
+        free_address(map, record->argument);
+      }
+      return;
+    }
+    remove_address(map, record->argument);
+    if (record->pointer != record->argument) {
+      free_address(map, record->pointer);
+    }
+    insert_address(map, record->pointer, slot);
+    add_replay_op(REPLAY_REALLOCATE, slot, record->size, 0);
+    return;
+  default:
+    return;
+  }
+}
+
+// Returns the number of recorded threads, 0 if the file isn't a trace
+size_t load_trace(const char *path) {
+  int trace_fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat trace_stat;
+  if (trace_fd < 0 || fstat(trace_fd, &trace_stat) < 0 ||
+      (size_t)trace_stat.st_size < sizeof(trace_header_t)) {
+    perror(path);
+    return 0;
+  }
+  trace_header_t *header =
+      mmap(NULL, trace_stat.st_size, PROT_READ, MAP_PRIVATE, trace_fd, 0);
+  close(trace_fd);
+  if (header == MAP_FAILED || header->magic != TRACE_MAGIC ||
+      header->version != TRACE_VERSION ||
+      header->record_size != sizeof(trace_record_t) ||
+      sizeof(trace_header_t) + header->capacity * sizeof(trace_record_t) >
+          (size_t)trace_stat.st_size) {
+    fprintf(stderr, "%s: not a trace\n", path);
+    return 0;
+  }
+
+  trace_record_count = header->next_record < header->capacity
+                           ? header->next_record
+                           : header->capacity;
+  size_t record_count = trace_record_count;
+  uint64_t first_record = header->next_record - record_count;
+  size_t cell_count = 1;
+  while (cell_count < 2 * record_count) {
+    cell_count *= 2;
+  }
+  address_map_t map = {map_array(cell_count, sizeof(uint64_t)),
+                       map_array(cell_count, sizeof(uint32_t)),
+                       cell_count - 1};
+  replay_ops = map_array(2 * record_count, sizeof(replay_op_t));
+  free_slots = map_array(record_count, sizeof(uint32_t));
+  replay_op_count = 0;
+  free_slot_count = 0;
+  slot_count = 0;
+
+  trace_record_t *records = get_trace_records(header);
+  uint64_t first_timestamp = 0, last_timestamp = 0;
+  size_t thread_count = 0;
+  for (size_t i = 0; i < record_count; ++i) {
+    trace_record_t *record =
+        &records[(first_record + i) % header->capacity];
+    translate_record(&map, record);
+    if (record->thread > thread_count) {
+      thread_count = record->thread;
+    }
+    if (!first_timestamp || record->timestamp < first_timestamp) {
+      first_timestamp = record->timestamp;
+    }
+    if (record->timestamp > last_timestamp) {
+      last_timestamp = record->timestamp;
+    }
+  }
+  printf("%s: %zu records of %zu threads over %.3f s, %zu replayed calls, "
+         "%u objects\n",
+         path, record_count, thread_count,
+         (last_timestamp - first_timestamp) / 1e9, replay_op_count,
+         slot_count);
+
+  munmap(map.addresses, cell_count * sizeof(uint64_t) + 1);
+  munmap(map.slots, cell_count * sizeof(uint32_t) + 1);
+  munmap(header, trace_stat.st_size);
+  // Prefaulted, so the slots don't count towards the replay's RSS
+  slot_objects = map_array(slot_count, sizeof(void *));
+  slot_sizes = map_array(slot_count, sizeof(uint64_t));
+  memset(slot_objects, 0, slot_count * sizeof(void *));
+  memset(slot_sizes, 0, slot_count * sizeof(uint64_t));
+  return thread_count ? thread_count : 1;
+}
+
+void replay_workload(bench_thread_t *threads, int thread_count,
+                     size_t parameter) {
+  (void)thread_count;
+  (void)parameter;
+  bench_thread_t *thread = &threads[0];
+  for (size_t i = 0; i < replay_op_count; ++i) {
+    replay_op_t *replay_op = &replay_ops[i];
+    uint32_t slot = replay_op->slot;
+    switch (replay_op->op) {
+    case REPLAY_ALLOCATE:
+      slot_objects[slot] = bench_allocate(thread, replay_op->size);
+      break;
+    case REPLAY_ALLOCATE_ZEROED:
+      slot_objects[slot] = bench_allocate_zeroed(thread, replay_op->size);
+      break;
+    case REPLAY_ALLOCATE_ALIGNED:
+      slot_objects[slot] = bench_allocate_aligned(thread, replay_op->alignment,
+                                                  replay_op->size);
+      break;
+    case REPLAY_REALLOCATE:
+      slot_objects[slot] = bench_reallocate(thread, slot_objects[slot],
+                                            slot_sizes[slot], replay_op->size);
+      break;
+    case REPLAY_FREE:
+      bench_free(thread, slot_objects[slot], slot_sizes[slot]);
+      continue;
+    }
+    slot_sizes[slot] = replay_op->size;
+    if (replay_op->size) {
+      touch_memory(slot_objects[slot], replay_op->size);
+    }
+  }
+}
+
+void unload_trace() {
+  munmap(replay_ops, 2 * trace_record_count * sizeof(replay_op_t) + 1);
+  munmap(free_slots, trace_record_count * sizeof(uint32_t) + 1);
+  munmap(slot_objects, slot_count * sizeof(void *) + 1);
+  munmap(slot_sizes, slot_count * sizeof(uint64_t) + 1);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s trace-file...\n", argv[0]);
+    return 1;
+  }
+  const allocator_ops_t *allocators[] = {&heap_allocator_ops, &glibc_ops};
+  int failures = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (!load_trace(argv[i])) {
+      failures++;
+      continue;
+    }
+    const char *name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1
+                                             : argv[i];
+    print_result_header();
+    for (int j = 0; j < 2; ++j) {
+      bench_result_t result;
+      failures += !run_benchmark(replay_workload, 0, allocators[j], 1,
+                                 &result);
+      print_result(name, allocators[j]->name, &result);
+    }
+    unload_trace();
+  }
+  return failures != 0;
+}
@@ -1,54 +1,834 @@
-#include <math.h>
+#define _GNU_SOURCE
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ 1
+#endif
+
 #include "allocator.h"
 
-mchunk_t *top = NULL;
-mchunk_t *bins[BIN_COUNT] = {NULL};
+arena_t main_arena = {.lock = PTHREAD_MUTEX_INITIALIZER};
+pthread_mutex_t arena_list_lock = PTHREAD_MUTEX_INITIALIZER;
+size_t arena_count = 1;
+size_t arena_limit = 0;
+size_t next_arena_to_assign = 0;
+size_t mmap_threshold = MMAP_THRESHOLD;
+int mmap_threshold_is_set = 0;
+size_t tcache_count = TCACHE_DEFAULT_COUNT;
+size_t percpu_cache_count = 0;
+int tracing = 0;
+size_t profile_sample_bytes = 0;
+allocator_stats_t global_stats;
+size_t fastbin_max_size = FASTBIN_MAX_SIZE;
+size_t trim_threshold = DEFAULT_TRIM_THRESHOLD;
+int trim_threshold_is_set = 0;
+size_t top_pad = DEFAULT_TOP_PAD;
+size_t release_threshold = DEFAULT_RELEASE_THRESHOLD;
+size_t slab_max_size = SLAB_MAX_SIZE;
+const unsigned short slab_class_sizes[SLAB_CLASS_COUNT] = SLAB_CLASS_SIZES;
+const unsigned char slab_class_lookup[SLAB_MAX_SIZE / MEM_ALIGNMENT] =
+    SLAB_CLASS_LOOKUP;
+#ifdef MADV_FREE
+int release_advice = MADV_FREE;
+#else
+int release_advice = MADV_DONTNEED;
+#endif
+
+_Thread_local arena_t *thread_arena;
+
+_Thread_local tcache_t tcache;
+_Thread_local int tcache_state = TCACHE_UNREGISTERED;
+pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+pthread_key_t tcache_key;
+
+percpu_cache_t *percpu_caches;
+size_t percpu_cache_cpus = 0;
+pthread_once_t percpu_caches_once = PTHREAD_ONCE_INIT;
+
+trace_header_t *trace_file;
+// Calls writing a record right now, trace_stop() waits for them
+unsigned int trace_writer_count = 0;
+unsigned int trace_thread_count = 0;
+_Thread_local unsigned int trace_thread_id;
+
+// Mapped by the first profile_start() and kept, live samples outlive it
+profile_sample_t *profile_samples;
+profile_sample_t **profile_buckets;
+profile_sample_t *free_profile_samples = NULL;
+size_t profile_samples_used = 0;
+size_t profile_sample_count = 0;
+// Rate of the last profile_start(), for the header of the profile
+size_t profile_sampling_rate = PROFILE_DEFAULT_SAMPLE_BYTES;
+pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+_Thread_local ptrdiff_t profile_bytes_until_sample;
+_Thread_local int profile_countdown_started;
+_Thread_local uint64_t profile_random_state;
+
+char *slab_batch = NULL;
+size_t slab_batch_left = 0;
+slab_run_t *empty_slab_runs = NULL;
+pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+thread_heap_t *abandoned_thread_heaps = NULL;
+
+_Thread_local thread_heap_t *thread_heap;
+_Thread_local int thread_heap_shut_down = 0;
+pthread_once_t thread_heap_key_once = PTHREAD_ONCE_INIT;
+pthread_key_t thread_heap_key;
+
+pagemap_node_t *pagemap[PAGEMAP_NODE_SIZE];
+
+/* Page map
+ * A three level radix tree keyed by page number. Every page the allocator
+ * hands out memory from maps to what owns it: the slab run, the arena of a
+ * heap or a mapped chunk, tagged with the kind in the low bits. That finds
+ * the metadata of a header-free slab object, and tells whether a pointer
+ * belongs to us at all. Nodes are mapped on demand and never freed, readers
+ * don't take any lock.
+ */
+
+void *create_pagemap_node() {
+  void *node = mmap(NULL, sizeof(pagemap_leaf_t), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return node == MAP_FAILED ? NULL : node;
+}
+
+// Concurrent writers may both create a node, the loser unmaps its own
+void *install_pagemap_node(void **slot) {
+  void *node = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (node) {
+    return node;
+  }
+  void *new_node = create_pagemap_node();
+  if (!new_node) {
+    return NULL;
+  }
+  if (!__atomic_compare_exchange_n(slot, &node, new_node, 0, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_ACQUIRE)) {
+    munmap(new_node, sizeof(pagemap_leaf_t));
+    return node;
+  }
+  return new_node;
+}
+
+uintptr_t *get_pagemap_entry(uintptr_t page, int create) {
+  if (page >> (3 * PAGEMAP_LEVEL_BITS)) {
+    return NULL;
+  }
+  size_t root_index = page >> (2 * PAGEMAP_LEVEL_BITS);
+  size_t node_index = (page >> PAGEMAP_LEVEL_BITS) & (PAGEMAP_NODE_SIZE - 1);
+  size_t leaf_index = page & (PAGEMAP_NODE_SIZE - 1);
+
+  pagemap_node_t *node =
+      create ? install_pagemap_node((void **)&pagemap[root_index])
+             : __atomic_load_n(&pagemap[root_index], __ATOMIC_ACQUIRE);
+  if (!node) {
+    return NULL;
+  }
+  pagemap_leaf_t *leaf =
+      create ? install_pagemap_node((void **)&node->leaves[node_index])
+             : __atomic_load_n(&node->leaves[node_index], __ATOMIC_ACQUIRE);
+  if (!leaf) {
+    return NULL;
+  }
+  return &leaf->entries[leaf_index];
+}
+
+uintptr_t lookup_page(void *address) {
+  uintptr_t page = (uintptr_t)address >> PAGEMAP_PAGE_SHIFT;
+  uintptr_t *entry = get_pagemap_entry(page, 0);
+  return entry ? __atomic_load_n(entry, __ATOMIC_RELAXED) : 0;
+}
+
+// Maps every page overlapping the memory to owner, 0 unmaps them. Returns 0
+// if the page map couldn't grow.
+int map_pages(void *memory, size_t memory_size, uintptr_t owner) {
+  uintptr_t first_page = (uintptr_t)memory >> PAGEMAP_PAGE_SHIFT;
+  uintptr_t end_page = ((uintptr_t)memory + memory_size +
+                        (1ul << PAGEMAP_PAGE_SHIFT) - 1) >>
+                       PAGEMAP_PAGE_SHIFT;
+  for (uintptr_t page = first_page; page < end_page; ++page) {
+    uintptr_t *entry = get_pagemap_entry(page, owner != 0);
+    if (!entry) {
+      if (owner) {
+        return 0;
+      }
+      continue;
+    }
+    __atomic_store_n(entry, owner, __ATOMIC_RELAXED);
+  }
+  return 1;
+}
+
+int get_page_kind(uintptr_t page_owner) { return page_owner & PAGE_KIND_MASK; }
+
+void *get_page_owner(uintptr_t page_owner) {
+  return (void *)(page_owner & ~(uintptr_t)PAGE_KIND_MASK);
+}
+
+/* Arenas
+ * Every arena is an independent heap with its own top, bins and lock. The
+ * main arena grows with sbrk(), the others live in ARENA_HEAP_SIZE aligned
+ * mmap'd heaps, which lets free_memory() find the owner of a chunk by
+ * rounding its address down to the heaps start. Threads stick to the arena
+ * they were assigned round-robin and only move when it's contended.
+ */
+
+size_t get_arena_flag(arena_t *arena) {
+  return arena == &main_arena ? 0 : NON_MAIN_ARENA;
+}
+
+heap_info_t *heap_for_chunk(mchunk_t *memory_chunk) {
+  return (heap_info_t *)((uintptr_t)memory_chunk & ~(ARENA_HEAP_SIZE - 1));
+}
+
+arena_t *chunk_arena(mchunk_t *memory_chunk) {
+  if (!is_in_non_main_arena(memory_chunk)) {
+    return &main_arena;
+  }
+  return heap_for_chunk(memory_chunk)->arena;
+}
+
+heap_info_t *create_heap(arena_t *arena) {
+  // Map twice the size to be able to cut an aligned heap out of the mapping
+  char *mapping =
+      mmap(NULL, 2 * ARENA_HEAP_SIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+  char *heap_start = (char *)(((uintptr_t)mapping + ARENA_HEAP_SIZE - 1) &
+                              ~(ARENA_HEAP_SIZE - 1));
+  size_t tail_size = mapping + ARENA_HEAP_SIZE - heap_start;
+  if (heap_start != mapping) {
+    munmap(mapping, heap_start - mapping);
+  }
+  if (tail_size) {
+    munmap(heap_start + ARENA_HEAP_SIZE, tail_size);
+  }
+
+  heap_info_t *heap = (heap_info_t *)heap_start;
+  heap->arena = arena;
+  heap->prev = NULL;
+  count_system_memory(&global_stats.heap_mapped_bytes, ARENA_HEAP_SIZE, NULL);
+  return heap;
+}
+
+void delete_heap(heap_info_t *heap) {
+  munmap(heap, ARENA_HEAP_SIZE);
+  count_system_memory(&global_stats.heap_mapped_bytes,
+                      -(ptrdiff_t)ARENA_HEAP_SIZE, NULL);
+}
+
+// The first heap of an arena also houses the arena itself
+void *get_heap_start(heap_info_t *heap) {
+  char *heap_start = (char *)(heap + 1);
+  if ((void *)heap->arena == heap_start) {
+    heap_start += sizeof(arena_t);
+  }
+  return (void *)align_up_to_multiple_of_16((size_t)heap_start);
+}
+
+size_t get_heap_capacity(heap_info_t *heap) {
+  return (char *)heap + ARENA_HEAP_SIZE - (char *)get_heap_start(heap);
+}
+
+arena_t *create_arena() {
+  heap_info_t *heap = create_heap(NULL);
+  if (!heap) {
+    return NULL;
+  }
+  arena_t *arena = (arena_t *)(heap + 1);
+  heap->arena = arena;
+  pthread_mutex_init(&arena->lock, NULL);
+  arena->heap = heap;
+  arena->heap_bytes = get_heap_capacity(heap);
+  start_top(arena, get_heap_start(heap), get_heap_capacity(heap));
+  return arena;
+}
+
+size_t get_arena_limit() {
+  if (!arena_limit) {
+    arena_limit = ARENAS_PER_CPU * sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  return arena_limit;
+}
+
+// Creates a new arena, already locked by the caller, unless there are
+// enough of them
+arena_t *add_arena() {
+  arena_t *arena = NULL;
+  pthread_mutex_lock(&arena_list_lock);
+  if (arena_count < get_arena_limit()) {
+    arena = create_arena();
+  }
+  if (arena) {
+    pthread_mutex_lock(&arena->lock);
+    arena->next = main_arena.next;
+    __atomic_store_n(&main_arena.next, arena, __ATOMIC_RELEASE);
+    __atomic_store_n(&arena_count, arena_count + 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&arena_list_lock);
+  return arena;
+}
+
+// Arenas form a ring starting at the main arena
+arena_t *get_next_arena(arena_t *arena) {
+  arena_t *next_arena = __atomic_load_n(&arena->next, __ATOMIC_ACQUIRE);
+  return next_arena ? next_arena : &main_arena;
+}
+
+arena_t *assign_arena() {
+  size_t arena_index =
+      __atomic_fetch_add(&next_arena_to_assign, 1, __ATOMIC_RELAXED) %
+      __atomic_load_n(&arena_count, __ATOMIC_RELAXED);
+  arena_t *arena = &main_arena;
+  while (arena_index--) {
+    arena = get_next_arena(arena);
+  }
+  return arena;
+}
+
+/* Returns the calling threads arena, locked. When someone else holds it the
+ * thread moves to the first idle arena, or to a new one while we're below
+ * the arena limit, and only blocks if neither is available.
+ */
+arena_t *get_thread_arena() {
+  if (!thread_arena) {
+    thread_arena = assign_arena();
+  }
+  return thread_arena;
+}
+
+arena_t *lock_thread_arena() {
+  arena_t *arena = get_thread_arena();
+  if (pthread_mutex_trylock(&arena->lock) == 0) {
+    return arena;
+  }
+
+  for (arena_t *candidate = get_next_arena(arena); candidate != arena;
+       candidate = get_next_arena(candidate)) {
+    if (pthread_mutex_trylock(&candidate->lock) == 0) {
+      thread_arena = candidate;
+      return candidate;
+    }
+  }
+  arena_t *new_arena = add_arena();
+  if (new_arena) {
+    thread_arena = new_arena;
+    return new_arena;
+  }
+  pthread_mutex_lock(&arena->lock);
+  return arena;
+}
+
+/* Fork handlers, for pthread_atfork(). The child only gets the forking
+ * thread, so any lock another thread held at fork() time would stay locked
+ * forever. Taking every lock before forking guarantees the heap is
+ * consistent, and the child re-initializes the locks instead of unlocking
+ * mutexes some other thread acquired. They're taken in a fixed order, the
+ * arena list, the arenas, then the slab and profile locks, and no thread
+ * nests them the other way round.
+ */
+void prepare_fork() {
+  pthread_mutex_lock(&arena_list_lock);
+  arena_t *arena = &main_arena;
+  do {
+    pthread_mutex_lock(&arena->lock);
+    arena = get_next_arena(arena);
+  } while (arena != &main_arena);
+  pthread_mutex_lock(&slab_lock);
+  pthread_mutex_lock(&profile_lock);
+}
+
+void release_fork_locks_in_parent() {
+  arena_t *arena = &main_arena;
+  do {
+    pthread_mutex_unlock(&arena->lock);
+    arena = get_next_arena(arena);
+  } while (arena != &main_arena);
+  pthread_mutex_unlock(&profile_lock);
+  pthread_mutex_unlock(&slab_lock);
+  pthread_mutex_unlock(&arena_list_lock);
+}
+
+void release_fork_locks_in_child() {
+  arena_t *arena = &main_arena;
+  do {
+    pthread_mutex_init(&arena->lock, NULL);
+    arena = get_next_arena(arena);
+  } while (arena != &main_arena);
+  pthread_mutex_init(&profile_lock, NULL);
+  pthread_mutex_init(&slab_lock, NULL);
+  pthread_mutex_init(&arena_list_lock, NULL);
+  // Writers caught by the fork are gone with their threads
+  trace_writer_count = 0;
+}
 
-void *create_top() {
+void *create_top(arena_t *arena) {
   void *sbrk_result = sbrk(HEAP_PAGE);
   if (sbrk_result == SBRK_ERR) {
     return sbrk_result;
   }
-  top = (mchunk_t *)sbrk_result;
-  top->size_with_flags = HEAP_PAGE;
-  set_chunks_flag(top, PREV_INUSE);
-  top->prev_size = 0;
+  count_system_memory(&global_stats.sbrk_bytes, HEAP_PAGE,
+                      &global_stats.peak_sbrk_bytes);
+  __atomic_store_n(&arena->heap_bytes, arena->heap_bytes + HEAP_PAGE,
+                   __ATOMIC_RELAXED);
+  start_main_heap(arena, sbrk_result, HEAP_PAGE);
   return sbrk_result;
 }
 
+void start_main_heap(arena_t *arena, void *memory, size_t memory_size) {
+  heap_info_t *heap =
+      (heap_info_t *)align_up_to_multiple_of_16((size_t)memory);
+  heap->arena = arena;
+  heap->prev = arena->heap;
+  arena->heap = heap;
+  char *heap_start = get_heap_start(heap);
+  start_top(arena, heap_start, (char *)memory + memory_size - heap_start);
+}
+
+void raise_peak(size_t *peak, size_t value) {
+  size_t current_peak = __atomic_load_n(peak, __ATOMIC_RELAXED);
+  while (value > current_peak &&
+         !__atomic_compare_exchange_n(peak, &current_peak, value, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+void count_system_memory(size_t *counter, ptrdiff_t delta, size_t *peak) {
+  size_t value = __atomic_add_fetch(counter, delta, __ATOMIC_RELAXED);
+  if (peak) {
+    raise_peak(peak, value);
+  }
+  size_t system_bytes =
+      __atomic_add_fetch(&global_stats.system_bytes, delta, __ATOMIC_RELAXED);
+  raise_peak(&global_stats.peak_system_bytes, system_bytes);
+}
+
+void update_top_bytes(arena_t *arena) {
+  __atomic_store_n(&arena->top_bytes, get_size(arena->top), __ATOMIC_RELAXED);
+}
+
+void count_free_chunk(arena_t *arena, int bin_number, size_t chunk_size,
+                      int chunk_delta) {
+  __atomic_store_n(&arena->bin_free_bytes[bin_number],
+                   arena->bin_free_bytes[bin_number] +
+                       (ptrdiff_t)chunk_delta * (ptrdiff_t)chunk_size,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&arena->free_chunk_count,
+                   arena->free_chunk_count + chunk_delta, __ATOMIC_RELAXED);
+}
+
+void count_in_use_chunk(arena_t *arena, int chunk_delta) {
+  __atomic_store_n(&arena->in_use_chunk_count,
+                   arena->in_use_chunk_count + chunk_delta, __ATOMIC_RELAXED);
+}
+
+void allocator_stats(allocator_stats_t *stats) {
+  memset(stats, 0, sizeof(allocator_stats_t));
+  stats->sbrk_bytes =
+      __atomic_load_n(&global_stats.sbrk_bytes, __ATOMIC_RELAXED);
+  stats->heap_mapped_bytes =
+      __atomic_load_n(&global_stats.heap_mapped_bytes, __ATOMIC_RELAXED);
+  stats->mmap_bytes =
+      __atomic_load_n(&global_stats.mmap_bytes, __ATOMIC_RELAXED);
+  stats->slab_mapped_bytes =
+      __atomic_load_n(&global_stats.slab_mapped_bytes, __ATOMIC_RELAXED);
+  stats->system_bytes =
+      __atomic_load_n(&global_stats.system_bytes, __ATOMIC_RELAXED);
+  stats->mmap_chunk_count =
+      __atomic_load_n(&global_stats.mmap_chunk_count, __ATOMIC_RELAXED);
+  stats->slab_bytes =
+      __atomic_load_n(&global_stats.slab_bytes, __ATOMIC_RELAXED);
+  stats->peak_sbrk_bytes =
+      __atomic_load_n(&global_stats.peak_sbrk_bytes, __ATOMIC_RELAXED);
+  stats->peak_mmap_bytes =
+      __atomic_load_n(&global_stats.peak_mmap_bytes, __ATOMIC_RELAXED);
+  stats->peak_system_bytes =
+      __atomic_load_n(&global_stats.peak_system_bytes, __ATOMIC_RELAXED);
+
+  size_t heap_bytes = 0;
+  stats->in_use_chunk_count = stats->mmap_chunk_count;
+  arena_t *arena = &main_arena;
+  do {
+    heap_bytes += __atomic_load_n(&arena->heap_bytes, __ATOMIC_RELAXED);
+    stats->top_bytes += __atomic_load_n(&arena->top_bytes, __ATOMIC_RELAXED);
+    stats->fastbin_bytes +=
+        __atomic_load_n(&arena->fastbin_bytes, __ATOMIC_RELAXED);
+    // Fastbin chunks are still in use as far as the heap is concerned, they
+    // are moved over to the free ones here
+    size_t fastbin_chunk_count =
+        __atomic_load_n(&arena->fastbin_chunk_count, __ATOMIC_RELAXED);
+    size_t in_use_chunk_count =
+        __atomic_load_n(&arena->in_use_chunk_count, __ATOMIC_RELAXED);
+    stats->free_chunk_count +=
+        __atomic_load_n(&arena->free_chunk_count, __ATOMIC_RELAXED) +
+        fastbin_chunk_count;
+    if (in_use_chunk_count > fastbin_chunk_count) {
+      stats->in_use_chunk_count += in_use_chunk_count - fastbin_chunk_count;
+    }
+    for (int i = 0; i < BIN_COUNT; ++i) {
+      size_t bin_bytes =
+          __atomic_load_n(&arena->bin_free_bytes[i], __ATOMIC_RELAXED);
+      stats->bin_free_bytes[i] += bin_bytes;
+      stats->free_bytes += bin_bytes;
+    }
+    arena = get_next_arena(arena);
+  } while (arena != &main_arena);
+
+  size_t unused_bytes =
+      stats->top_bytes + stats->free_bytes + stats->fastbin_bytes;
+  stats->free_bytes += stats->fastbin_bytes;
+  stats->in_use_bytes = stats->mmap_bytes + stats->slab_bytes;
+  if (heap_bytes > unused_bytes) {
+    stats->in_use_bytes += heap_bytes - unused_bytes;
+  }
+}
+
+// Places a fresh top chunk at the start of newly acquired memory
+void start_top(arena_t *arena, void *memory, size_t memory_size) {
+  map_pages(memory, memory_size, (uintptr_t)arena | PAGE_HEAP);
+  arena->heap_end = (char *)memory + memory_size;
+  mchunk_t *top = (mchunk_t *)align_up_to_multiple_of_16((size_t)memory);
+  top->size_with_flags =
+      ((char *)arena->heap_end - (char *)top) & ~(MEM_ALIGNMENT - 1);
+  set_chunks_flag(top, PREV_INUSE | get_arena_flag(arena));
+  top->prev_size = 0;
+  arena->top = top;
+  arena->untouched_start = (char *)top + CHUNK_HDR_SIZE;
+  update_top_bytes(arena);
+}
+
+/* Closes off the current top when the heap has to continue in memory that
+ * isn't contiguous with it. The last header of the old top becomes a
+ * fencepost: a zero sized chunk marked as in use, so nothing ever coalesces
+ * across the gap and heap walks know where the heap ends. Whatever is left in
+ * front of it goes to the bins, a top too small for that becomes the
+ * fencepost itself.
+ */
+void retire_top(arena_t *arena) {
+  mchunk_t *top = arena->top;
+  size_t top_size = get_size(top);
+  if (top_size < MIN_CHUNK_SIZE + CHUNK_HDR_SIZE) {
+    top->size_with_flags =
+        (top->size_with_flags & PREV_INUSE) | IS_INUSE | get_arena_flag(arena);
+    return;
+  }
+  mchunk_t *fencepost = (mchunk_t *)((char *)top + top_size - CHUNK_HDR_SIZE);
+  fencepost->prev_size = top_size - CHUNK_HDR_SIZE;
+  fencepost->size_with_flags = IS_INUSE | get_arena_flag(arena);
+  top->size_with_flags -= CHUNK_HDR_SIZE;
+  add_chunk_to_bin(arena, top);
+}
+
 // pimpcio
 //  Extends the top by the minimum number of pages to house a chunk of given
-//  size
-void *extend_top(size_t memory_size) {
+//  size. Something else in the process (e.g. libc's malloc) may have moved the
+//  program break since our last sbrk(), in which case the heap continues in
+//  the new memory. Other arenas can't use sbrk() and continue in a new heap
+//  instead.
+void *extend_top(arena_t *arena, size_t memory_size) {
+  if (arena != &main_arena) {
+    heap_info_t *heap = create_heap(arena);
+    if (!heap) {
+      return SBRK_ERR;
+    }
+    if (get_heap_capacity(heap) < memory_size + MIN_CHUNK_SIZE) {
+      delete_heap(heap);
+      return SBRK_ERR;
+    }
+    heap->prev = arena->heap;
+    arena->heap = heap;
+    __atomic_store_n(&arena->heap_bytes,
+                     arena->heap_bytes + get_heap_capacity(heap),
+                     __ATOMIC_RELAXED);
+    retire_top(arena);
+    start_top(arena, get_heap_start(heap), get_heap_capacity(heap));
+    return heap;
+  }
+
+  // With room for the header, in case the heap can't continue in place
   size_t minimal_extension_size =
-      (memory_size + HEAP_PAGE - 1) / (HEAP_PAGE)*HEAP_PAGE;
+      (memory_size + MIN_CHUNK_SIZE + sizeof(heap_info_t) + MEM_ALIGNMENT +
+       HEAP_PAGE - 1) /
+      (HEAP_PAGE)*HEAP_PAGE;
   void *extension_result = sbrk(minimal_extension_size);
   if (extension_result == SBRK_ERR) {
     return extension_result;
   }
-  top->size_with_flags += minimal_extension_size;
+  count_system_memory(&global_stats.sbrk_bytes, minimal_extension_size,
+                      &global_stats.peak_sbrk_bytes);
+  __atomic_store_n(&arena->heap_bytes,
+                   arena->heap_bytes + minimal_extension_size,
+                   __ATOMIC_RELAXED);
+  if (extension_result != arena->heap_end) {
+    retire_top(arena);
+    start_main_heap(arena, extension_result, minimal_extension_size);
+    return extension_result;
+  }
+  map_pages(extension_result, minimal_extension_size,
+            (uintptr_t)arena | PAGE_HEAP);
+  arena->heap_end = (char *)extension_result + minimal_extension_size;
+  arena->top->size_with_flags += minimal_extension_size;
+  update_top_bytes(arena);
   return extension_result;
 }
 
+/* Gives the pages at the end of the top back to the kernel, keeping pad
+ * bytes on top of the minimal chunk. The main arena shrinks the program
+ * break, unless something else has moved it since our last sbrk(). Heaps of
+ * other arenas can't shrink, so their pages are released in place instead,
+ * only the ones touched since the last release. Returns whether any memory
+ * was released.
+ */
+int trim_top(arena_t *arena, size_t pad) {
+  size_t page_size = get_page_size();
+  mchunk_t *top = arena->top;
+  if (!top) {
+    return 0;
+  }
+  char *release_start = (char *)(((uintptr_t)top + MIN_CHUNK_SIZE + pad +
+                                  page_size - 1) &
+                                 ~(page_size - 1));
+
+  if (arena != &main_arena) {
+    char *untouched_start =
+        (char *)(((uintptr_t)arena->untouched_start + page_size - 1) &
+                 ~(page_size - 1));
+    if (release_start >= untouched_start) {
+      return 0;
+    }
+    madvise(release_start, untouched_start - release_start, MADV_DONTNEED);
+    arena->untouched_start = release_start;
+    return 1;
+  }
+
+  char *top_end = (char *)top + get_size(top);
+  if (release_start + page_size > top_end || sbrk(0) != arena->heap_end ||
+      __atomic_load_n(&arena->fastbin_poppers, __ATOMIC_SEQ_CST)) {
+    return 0;
+  }
+  if (sbrk(-((char *)arena->heap_end - release_start)) == SBRK_ERR) {
+    return 0;
+  }
+  size_t released_size = (char *)arena->heap_end - release_start;
+  map_pages(release_start, released_size, 0);
+  count_system_memory(&global_stats.sbrk_bytes, -(ptrdiff_t)released_size,
+                      NULL);
+  __atomic_store_n(&arena->heap_bytes, arena->heap_bytes - released_size,
+                   __ATOMIC_RELAXED);
+  arena->heap_end = release_start;
+  top->size_with_flags -= top_end - release_start;
+  update_top_bytes(arena);
+  if (arena->untouched_start > arena->heap_end) {
+    arena->untouched_start = arena->heap_end;
+  }
+  return 1;
+}
+
+int allocator_trim(size_t pad) {
+  int released = 0;
+  arena_t *arena = &main_arena;
+  do {
+    pthread_mutex_lock(&arena->lock);
+    consolidate_fastbins(arena);
+    released |= trim_top(arena, pad);
+    pthread_mutex_unlock(&arena->lock);
+    arena = get_next_arena(arena);
+  } while (arena != &main_arena);
+  return released;
+}
+
+void walk_arena(arena_t *arena, heap_walk_callback_t callback, void *context) {
+  for (heap_info_t *heap = arena->heap; heap; heap = heap->prev) {
+    mchunk_t *memory_chunk = get_heap_start(heap);
+    while (memory_chunk != arena->top && get_size(memory_chunk)) {
+      callback(arena, memory_chunk, context);
+      memory_chunk = get_next_chunk(memory_chunk);
+    }
+    if (memory_chunk == arena->top) {
+      callback(arena, memory_chunk, context);
+    }
+  }
+}
+
+void heap_walk(heap_walk_callback_t callback, void *context) {
+  arena_t *arena = &main_arena;
+  do {
+    pthread_mutex_lock(&arena->lock);
+    walk_arena(arena, callback, context);
+    pthread_mutex_unlock(&arena->lock);
+    arena = get_next_arena(arena);
+  } while (arena != &main_arena);
+}
+
+void analyze_chunk(arena_t *arena, mchunk_t *memory_chunk, void *context) {
+  heap_analysis_t *analysis = context;
+  size_t chunk_size = get_size(memory_chunk);
+  if (memory_chunk == arena->top) {
+    analysis->top_bytes += chunk_size;
+    return;
+  }
+  if (is_in_use(memory_chunk)) {
+    analysis->in_use_chunk_count++;
+    analysis->in_use_bytes += chunk_size;
+    return;
+  }
+  analyze_free_chunk(analysis, chunk_size);
+}
+
+void analyze_free_chunk(heap_analysis_t *analysis, size_t chunk_size) {
+  analysis->free_chunk_count++;
+  analysis->free_bytes += chunk_size;
+  if (chunk_size > analysis->largest_free_chunk) {
+    analysis->largest_free_chunk = chunk_size;
+  }
+  int bucket = 8 * sizeof(size_t) - 1 - __builtin_clzl(chunk_size);
+  analysis->size_histogram[bucket]++;
+  analysis->size_histogram_bytes[bucket] += chunk_size;
+  int bin_number = find_appropriate_bin(chunk_size);
+  analysis->bin_chunk_count[bin_number]++;
+  analysis->bin_free_bytes[bin_number] += chunk_size;
+}
+
+/* Fastbin chunks keep IS_INUSE, so the walk counted them as in use. Each list
+ * is detached while it's counted, so no thread pops a chunk off it midway,
+ * and then pushed back whole in front of whatever got freed meanwhile.
+ */
+void analyze_fastbins(arena_t *arena, heap_analysis_t *analysis) {
+  for (unsigned int i = 0; i < FASTBIN_COUNT; ++i) {
+    uintptr_t head = __atomic_load_n(&arena->fastbins[i], __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&arena->fastbins[i], &head,
+                                        make_fastbin_head(NULL, head), 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    }
+    mchunk_t *first_chunk = get_fastbin_chunk(head);
+    mchunk_t *last_chunk = NULL;
+    for (mchunk_t *memory_chunk = first_chunk; memory_chunk;
+         memory_chunk = memory_chunk->fd_chunk) {
+      size_t chunk_size = get_size(memory_chunk);
+      analysis->in_use_chunk_count--;
+      analysis->in_use_bytes -= chunk_size;
+      analyze_free_chunk(analysis, chunk_size);
+      last_chunk = memory_chunk;
+    }
+    if (!last_chunk) {
+      continue;
+    }
+    head = __atomic_load_n(&arena->fastbins[i], __ATOMIC_RELAXED);
+    do {
+      last_chunk->fd_chunk = get_fastbin_chunk(head);
+    } while (!__atomic_compare_exchange_n(
+        &arena->fastbins[i], &head, make_fastbin_head(first_chunk, head), 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+}
+
+void analyze_heap(heap_analysis_t *analysis) {
+  memset(analysis, 0, sizeof(heap_analysis_t));
+  arena_t *arena = &main_arena;
+  do {
+    pthread_mutex_lock(&arena->lock);
+    walk_arena(arena, analyze_chunk, analysis);
+    analyze_fastbins(arena, analysis);
+    for (heap_info_t *heap = arena->heap; heap; heap = heap->prev) {
+      analysis->heap_count++;
+    }
+    pthread_mutex_unlock(&arena->lock);
+    arena = get_next_arena(arena);
+  } while (arena != &main_arena);
+  if (analysis->free_bytes) {
+    analysis->fragmentation =
+        1.0 - (double)analysis->largest_free_chunk / analysis->free_bytes;
+  }
+}
+
+int write_all(int fd, const char *buffer, size_t size) {
+  while (size) {
+    ssize_t written = write(fd, buffer, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    buffer += written;
+    size -= written;
+  }
+  return 0;
+}
+
+int write_formatted(int fd, const char *format, ...) {
+  char buffer[256];
+  va_list arguments;
+  va_start(arguments, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, arguments);
+  va_end(arguments);
+  if (length < 0) {
+    return -1;
+  }
+  if ((size_t)length >= sizeof(buffer)) {
+    length = sizeof(buffer) - 1;
+  }
+  return write_all(fd, buffer, length);
+}
+
+void print_heap_analysis(int fd, const heap_analysis_t *analysis) {
+  write_formatted(fd,
+                  "heaps %zu, in use %zu bytes in %zu chunks, free %zu bytes "
+                  "in %zu chunks, top %zu bytes\n",
+                  analysis->heap_count, analysis->in_use_bytes,
+                  analysis->in_use_chunk_count, analysis->free_bytes,
+                  analysis->free_chunk_count, analysis->top_bytes);
+  write_formatted(fd, "largest free chunk %zu bytes, fragmentation %.3f\n",
+                  analysis->largest_free_chunk, analysis->fragmentation);
+  write_formatted(fd, "free chunk sizes:\n");
+  for (size_t i = 0; i < SIZE_HISTOGRAM_BUCKETS; ++i) {
+    if (analysis->size_histogram[i]) {
+      write_formatted(fd, "  %12zu - %12zu: %8zu chunks %12zu bytes\n",
+                      (size_t)1 << i, ((size_t)2 << i) - 1,
+                      analysis->size_histogram[i],
+                      analysis->size_histogram_bytes[i]);
+    }
+  }
+  write_formatted(fd, "free bytes by bin:\n");
+  for (int i = 0; i < BIN_COUNT; ++i) {
+    if (analysis->bin_chunk_count[i]) {
+      write_formatted(fd, "  bin %3d: %8zu chunks %12zu bytes\n", i,
+                      analysis->bin_chunk_count[i],
+                      analysis->bin_free_bytes[i]);
+    }
+  }
+}
+
 // We can't slice off the whole top chunk because it requires having some
 // space left for its header
-int is_top_too_small(size_t memory_size) {
-  size_t top_size = get_size(top);
+int is_top_too_small(arena_t *arena, size_t memory_size) {
+  size_t top_size = get_size(arena->top);
   if (top_size < memory_size) {
     return 1;
   }
   return (top_size - memory_size) < MIN_CHUNK_SIZE;
 }
 
-/* Two LSBs of our mchunks size are flags containing whether:
+/* Four LSBs of our mchunks size are flags containing whether:
  * 1. The previous chunk is currently in use
  * 2. Is this chunk in use
  * 3. This chunk was allocated using mmap() instead of sbrk()
+ * 4. This chunk belongs to one of the mmap'd heaps of a non-main arena
  */
 
 int is_prev_mchunk_in_use(mchunk_t *memory_chunk) {
@@ -63,6 +843,10 @@ int is_in_use(mchunk_t *memory_chunk) {
   return memory_chunk->size_with_flags & IS_INUSE;
 }
 
+int is_in_non_main_arena(mchunk_t *memory_chunk) {
+  return memory_chunk->size_with_flags & NON_MAIN_ARENA;
+}
+
 void set_chunks_flag(mchunk_t *memory_chunk, unsigned long flag) {
   memory_chunk->size_with_flags |= flag;
 }
@@ -75,6 +859,14 @@ size_t get_size(mchunk_t *memory_chunk) {
   return memory_chunk->size_with_flags & ~(ALL_FLAGS);
 }
 
+size_t get_page_size() {
+  static size_t page_size = 0;
+  if (!page_size) {
+    page_size = sysconf(_SC_PAGESIZE);
+  }
+  return page_size;
+}
+
 size_t calculate_needed_memory(size_t chunks_payload) {
   size_t needed_memory = chunks_payload + CHUNK_HDR_SIZE <= MIN_CHUNK_SIZE
                              ? MIN_CHUNK_SIZE
@@ -109,18 +901,28 @@ size_t calculate_aligned_memory(size_t memory_size) {
  * function is going to return NULL
  */
 
-void *create_chunk_and_return_payloads_pointer(size_t memory_size) {
+void *create_chunk_and_return_payloads_pointer(arena_t *arena,
+                                               size_t memory_size) {
+  mchunk_t *top = arena->top;
   void *return_ptr = (char *)top + CHUNK_HDR_SIZE;
 
-  // set allocated chunks size and flag
-  top->size_with_flags = memory_size;
+  size_t top_size = get_size(top);
+
+  // set allocated chunks size and flags, it inherits PREV_INUSE from the top
+  top->size_with_flags =
+      memory_size | (top->size_with_flags & (PREV_INUSE | NON_MAIN_ARENA));
   set_chunks_flag(top, IS_INUSE);
 
   // create 'new' top and set its variables
   top = (mchunk_t *)((char *)top + memory_size);
-  top->size_with_flags = (char *)sbrk(0) - (char *)top;
+  top->size_with_flags = top_size - memory_size;
   top->prev_size = memory_size;
-  set_chunks_flag(top, PREV_INUSE);
+  set_chunks_flag(top, PREV_INUSE | get_arena_flag(arena));
+  arena->top = top;
+  if ((char *)top + CHUNK_HDR_SIZE > (char *)arena->untouched_start) {
+    arena->untouched_start = (char *)top + CHUNK_HDR_SIZE;
+  }
+  update_top_bytes(arena);
 
   return return_ptr;
 }
@@ -144,25 +946,30 @@ mchunk_t *get_previous_chunk(mchunk_t *memory_chunk) {
   return previous_chunk;
 }
 
-void remove_from_bin(mchunk_t *memory_chunk) {
-
-  // check whether memory_chunk is some bins head
-  for (int i = 0; i < BIN_COUNT; ++i) {
-    if (bins[i] == memory_chunk) {
-      bins[i] = memory_chunk->fd_chunk;
-      if (memory_chunk->fd_chunk) {
-        memory_chunk->fd_chunk->bk_chunk = NULL;
-      }
-      memory_chunk->fd_chunk = memory_chunk->bk_chunk = NULL;
-      return;
+// Only a bins head has no back link, and which bin it heads follows from its
+// size (unless it heads the unsorted bin), so unlinking never has to search
+// the bins
+void remove_from_bin(arena_t *arena, mchunk_t *memory_chunk) {
+  size_t chunk_size = get_size(memory_chunk);
+  int bin_number = find_appropriate_bin(chunk_size);
+  count_free_chunk(arena, bin_number, chunk_size, -1);
+  if (arena->bins[UNSORTED_BIN] == memory_chunk) {
+    arena->bins[UNSORTED_BIN] = memory_chunk->fd_chunk;
+    if (memory_chunk->fd_chunk) {
+      memory_chunk->fd_chunk->bk_chunk = NULL;
     }
-  }
-
-  if (memory_chunk->bk_chunk) {
+  } else if (!memory_chunk->bk_chunk) {
+    arena->bins[bin_number] = memory_chunk->fd_chunk;
+    if (memory_chunk->fd_chunk) {
+      memory_chunk->fd_chunk->bk_chunk = NULL;
+    } else {
+      unmark_bin(arena, bin_number);
+    }
+  } else {
     memory_chunk->bk_chunk->fd_chunk = memory_chunk->fd_chunk;
-  }
-  if (memory_chunk->fd_chunk) {
-    memory_chunk->fd_chunk->bk_chunk = memory_chunk->bk_chunk;
+    if (memory_chunk->fd_chunk) {
+      memory_chunk->fd_chunk->bk_chunk = memory_chunk->bk_chunk;
+    }
   }
   memory_chunk->fd_chunk = memory_chunk->bk_chunk = NULL;
 }
@@ -174,18 +981,19 @@ mchunk_t *coalesce_two_chunks(mchunk_t *previous_chunk, mchunk_t *next_chunk) {
 
 // TODO: refactor this function
 //       correctly set prev_size variable and prev_in_use flag for new chunk
-mchunk_t *coalesce_neighbouring_chunks(mchunk_t *memory_chunk) {
+mchunk_t *coalesce_neighbouring_chunks(arena_t *arena,
+                                       mchunk_t *memory_chunk) {
   // If exists coalesce with previous chunk
   if (!(memory_chunk->prev_size == 0) && !is_prev_mchunk_in_use(memory_chunk)) {
     mchunk_t *previous_chunk = get_previous_chunk(memory_chunk);
-    remove_from_bin(previous_chunk);
+    remove_from_bin(arena, previous_chunk);
     memory_chunk = coalesce_two_chunks(previous_chunk, memory_chunk);
   }
 
   // If exists and is not top coalesce with next chunk
   mchunk_t *next_chunk = get_next_chunk(memory_chunk);
-  if (next_chunk != top && !is_in_use(next_chunk)) {
-    remove_from_bin(next_chunk);
+  if (next_chunk != arena->top && !is_in_use(next_chunk)) {
+    remove_from_bin(arena, next_chunk);
     memory_chunk = coalesce_two_chunks(memory_chunk, next_chunk);
   }
 
@@ -195,46 +1003,52 @@ mchunk_t *coalesce_neighbouring_chunks(mchunk_t *memory_chunk) {
   return memory_chunk;
 }
 
-/*
- * bins[0] = N/A
- * bins[1] = unsorted bin (to be implemented)
- * bins[2-63] = small bins(ranging from 32 to 1008 bytes)
- * bins[64-95] = large bins with 64 byte spacing
- * bins[96-111] = large bins with 512 byte spacing
- * bins[112-119] = large bins with 4096 byte spacing
- * bins[120-121] = large bins with 32768 byte spacing
- * bins[122] = whats left
- * */
+// The bin layout is described in size_classes.h
 int find_appropriate_bin(size_t memory_size) {
   // SMALL BINS
-  // TODO: get rid of magic numbers
   if (memory_size <= SMALL_BIN_MAX) {
-    return memory_size / 16;
-  } else if (memory_size <= LARGE_BIN_64_BYTE_SPACING_MAX) {
-    return 63 + ceil((memory_size - SMALL_BIN_MAX) / 64.0);
-
-  } else if (memory_size <= LARGE_BIN_512_BYTE_SPACING_MAX) {
-    return 95 + ceil((memory_size - LARGE_BIN_64_BYTE_SPACING_MAX) / 512.0);
-
-  } else if (memory_size <= LARGE_BIN_4096_BYTE_SPACING_MAX) {
-    return 111 + ceil((memory_size - LARGE_BIN_512_BYTE_SPACING_MAX) / 4096.0);
+    return memory_size >> 4;
+  }
 
-  } else if (memory_size <= LARGE_BIN_32768_BYTE_SPACING_MAX) {
-    return 119 +
-           ceil((memory_size - LARGE_BIN_4096_BYTE_SPACING_MAX) / 32768.0);
+  /* LARGE BINS
+   * Every spacing tier starts right after the previous one ends, so counting
+   * the tier boundaries below the size selects the tier without branching.
+   * Within a tier the bin is a rounded up shift by the log2 of its spacing.
+   * The last tier has a single bin as wide as the address space.
+   */
+  static const size_t tier_start[] = LARGE_BIN_TIER_START;
+  static const int tier_first_bin[] = LARGE_BIN_TIER_FIRST_BIN;
+  static const unsigned char tier_shift[] = LARGE_BIN_TIER_SHIFT;
 
-  } else {
-    return BIN_COUNT - 1;
+  int tier = 0;
+  for (int boundary = 1; boundary < LARGE_BIN_TIER_COUNT; ++boundary) {
+    tier += memory_size > tier_start[boundary];
   }
+  size_t spacing_mask = (1ul << tier_shift[tier]) - 1;
+  return tier_first_bin[tier] +
+         ((memory_size - tier_start[tier] + spacing_mask) >> tier_shift[tier]);
 }
 
-void add_chunk_to_bin(mchunk_t *memory_chunk) {
+void add_chunk_to_bin(arena_t *arena, mchunk_t *memory_chunk) {
+  mchunk_t **bins = arena->bins;
   size_t true_size = get_size(memory_chunk);
   int bin_number = find_appropriate_bin(true_size);
+  count_free_chunk(arena, bin_number, true_size, 1);
   memory_chunk->fd_chunk = memory_chunk->bk_chunk = NULL;
 
+  if (true_size >= RELEASE_MIN_SIZE) {
+    *get_release_marker(memory_chunk) = 0;
+    arena->unreleased_bytes += true_size;
+    if (release_threshold && arena->unreleased_bytes >= release_threshold) {
+      // The chunk isn't linked yet, so it's released right away
+      release_chunk_pages(memory_chunk);
+      release_free_chunks(arena);
+    }
+  }
+
   if (bins[bin_number] == NULL) {
     bins[bin_number] = memory_chunk;
+    mark_bin(arena, bin_number);
     return;
   }
 
@@ -259,94 +1073,1918 @@ void add_chunk_to_bin(mchunk_t *memory_chunk) {
   current->fd_chunk = memory_chunk;
 }
 
-mchunk_t *find_and_remove_chunk_from_bin(size_t memory_size) {
-  int bin_number = find_appropriate_bin(memory_size);
-  for (int i = bin_number; i < BIN_COUNT; i++) {
-    mchunk_t *current = bins[i];
-    while (current) {
-      if (get_size(current) >= memory_size) {
-        remove_from_bin(current);
-        return current;
-      }
-      current = current->fd_chunk;
-    }
-  }
-  return NULL;
-}
-void merge_chunk_with_top(mchunk_t *memory_chunk) {
-  size_t top_size = get_size(top);
-  top = memory_chunk;
-  top->size_with_flags += top_size;
+// Large free chunks remember whether their pages were released in the word
+// right after their header, which is never released itself
+size_t *get_release_marker(mchunk_t *memory_chunk) {
+  return (size_t *)((char *)memory_chunk + sizeof(mchunk_t));
 }
 
-void free_sbrk_memory(mchunk_t *memory_chunk) {
-  mchunk_t *coalesced_chunk = coalesce_neighbouring_chunks(memory_chunk);
-
-  mchunk_t *next_chunk = get_next_chunk(coalesced_chunk);
-  unset_chunks_flag(next_chunk, PREV_INUSE);
+int is_chunk_released(mchunk_t *memory_chunk) {
+  return *get_release_marker(memory_chunk) != 0;
+}
 
-  // Merge newly coalesced chunk with the top
-  if (next_chunk == top) {
-    merge_chunk_with_top(coalesced_chunk);
+/* Releases the pages lying entirely inside a free chunk. The header, the
+ * release marker and the next chunk's header stay resident, so the chunk can
+ * still be coalesced and sorted as usual. MADV_FREE lets the kernel take the
+ * pages lazily; kernels without it get MADV_DONTNEED.
+ */
+void release_chunk_pages(mchunk_t *memory_chunk) {
+  size_t page_size = get_page_size();
+  uintptr_t interior_start =
+      ((uintptr_t)memory_chunk + sizeof(mchunk_t) + sizeof(size_t) +
+       page_size - 1) &
+      ~(page_size - 1);
+  uintptr_t interior_end =
+      ((uintptr_t)memory_chunk + get_size(memory_chunk)) & ~(page_size - 1);
+  *get_release_marker(memory_chunk) = 1;
+  if (interior_start >= interior_end) {
     return;
   }
-  add_chunk_to_bin(coalesced_chunk);
+  size_t interior_size = interior_end - interior_start;
+  if (madvise((void *)interior_start, interior_size, release_advice) != 0 &&
+      release_advice != MADV_DONTNEED) {
+    release_advice = MADV_DONTNEED;
+    madvise((void *)interior_start, interior_size, release_advice);
+  }
 }
 
-void *allocate_with_mmap(size_t memory_size) {}
-
-void *allocate_with_sbrk(size_t memory_size) {
-  void *memory_ptr;
-  // Check bins for appropriate allocations
-  mchunk_t *memory_chunk = find_and_remove_chunk_from_bin(memory_size);
-  //
-  // Set appropriate flags for the found chunk and its neighbour
-  if (memory_chunk) {
-    set_chunks_flag(memory_chunk, IS_INUSE);
-    mchunk_t *following = get_next_chunk(memory_chunk);
-    set_chunks_flag(following, PREV_INUSE);
-    memory_ptr = mchunk_into_payload(memory_chunk);
-    return memory_ptr;
+/* Walks the large bins and releases every chunk that was sorted into them
+ * since the last pass. Passes only run once release_threshold bytes of large
+ * free chunks have piled up, which keeps the madvise() calls amortized over
+ * many frees.
+ */
+void release_free_chunks(arena_t *arena) {
+  for (int bin_number = find_appropriate_bin(RELEASE_MIN_SIZE);
+       bin_number < BIN_COUNT; ++bin_number) {
+    for (mchunk_t *current = arena->bins[bin_number]; current;
+         current = current->fd_chunk) {
+      if (get_size(current) >= RELEASE_MIN_SIZE &&
+          !is_chunk_released(current)) {
+        release_chunk_pages(current);
+      }
+    }
   }
+  arena->unreleased_bytes = 0;
+}
 
-  // Check whether top exists and if it's big enough
-  void *result_ptr = NULL;
-  if (!top) {
-    void *creation_result = create_top();
-    if (creation_result == SBRK_ERR) {
-      return NULL;
-    }
+/* Freed chunks are pushed onto the unsorted bin instead of being sorted into
+ * their bins right away. The next allocations sort them, unless they find an
+ * exact fit on the way, so a chunk that is freed and soon requested again
+ * never gets sorted at all.
+ */
+void add_chunk_to_unsorted_bin(arena_t *arena, mchunk_t *memory_chunk) {
+  size_t chunk_size = get_size(memory_chunk);
+  count_free_chunk(arena, find_appropriate_bin(chunk_size), chunk_size, 1);
+  mchunk_t *head = arena->bins[UNSORTED_BIN];
+  memory_chunk->bk_chunk = NULL;
+  memory_chunk->fd_chunk = head;
+  if (head) {
+    head->bk_chunk = memory_chunk;
   }
-  if (is_top_too_small(memory_size)) {
-    void *extension_result = extend_top(memory_size);
-    if (extension_result == SBRK_ERR) {
-      return NULL;
+  arena->bins[UNSORTED_BIN] = memory_chunk;
+}
+
+// Sorts the unsorted chunks into their bins, stopping at and returning the
+// first one that fits memory_size exactly
+mchunk_t *sort_unsorted_bin(arena_t *arena, size_t memory_size) {
+  mchunk_t *current;
+  while ((current = arena->bins[UNSORTED_BIN])) {
+    remove_from_bin(arena, current);
+    if (get_size(current) == memory_size) {
+      return current;
     }
+    add_chunk_to_bin(arena, current);
   }
+  return NULL;
+}
 
-  // Slice a chunk off top
-  memory_ptr = create_chunk_and_return_payloads_pointer(memory_size);
-  return memory_ptr;
+/* The binmap has a bit set for every non-empty bin, so the next bin that can
+ * serve a request is one ctz() away instead of a scan over the bin heads.
+ */
+void mark_bin(arena_t *arena, int bin_number) {
+  arena->binmap[bin_number / BINMAP_WORD_BITS] |=
+      1ul << (bin_number % BINMAP_WORD_BITS);
 }
 
-void free_memory(void *payload_ptr) {
-  if (!payload_ptr)
-    return;
-  mchunk_t *memory_chunk = payload_into_mchunk(payload_ptr);
-  if (is_chunk_mmaped(memory_chunk)) {
-    // UNMMAP
+void unmark_bin(arena_t *arena, int bin_number) {
+  arena->binmap[bin_number / BINMAP_WORD_BITS] &=
+      ~(1ul << (bin_number % BINMAP_WORD_BITS));
+}
+
+int is_bin_marked(arena_t *arena, int bin_number) {
+  return (arena->binmap[bin_number / BINMAP_WORD_BITS] >>
+          (bin_number % BINMAP_WORD_BITS)) &
+         1;
+}
+
+// Returns the first non-empty bin starting from bin_number, or -1
+int find_next_marked_bin(arena_t *arena, int bin_number) {
+  if (bin_number >= BIN_COUNT) {
+    return -1;
+  }
+  int word = bin_number / BINMAP_WORD_BITS;
+  unsigned long bits =
+      arena->binmap[word] & (~0ul << (bin_number % BINMAP_WORD_BITS));
+  while (!bits) {
+    if (++word == BINMAP_WORDS) {
+      return -1;
+    }
+    bits = arena->binmap[word];
+  }
+  return word * BINMAP_WORD_BITS + __builtin_ctzl(bits);
+}
+
+/* Bins hold ascending size ranges and every list is sorted, so only the
+ * requests own bin may hold chunks that are too small for it (and only a
+ * large bin, small bins hold a single size). Any chunk in a later bin fits,
+ * so the head of the next marked bin, its smallest chunk, is taken directly.
+ */
+mchunk_t *find_and_remove_chunk_from_bin(arena_t *arena, size_t memory_size) {
+  int bin_number = find_appropriate_bin(memory_size);
+  mchunk_t *current = arena->bins[bin_number];
+  while (current && get_size(current) < memory_size) {
+    current = current->fd_chunk;
+  }
+  if (!current) {
+    int next_bin = find_next_marked_bin(arena, bin_number + 1);
+    if (next_bin < 0) {
+      return NULL;
+    }
+    current = arena->bins[next_bin];
+  }
+  remove_from_bin(arena, current);
+  return current;
+}
+
+// Gives back the part of a chunk taken from the bins that the request
+// doesn't need, when it's big enough to be a chunk on its own
+void split_chunk(arena_t *arena, mchunk_t *memory_chunk, size_t memory_size) {
+  size_t remainder_size = get_size(memory_chunk) - memory_size;
+  if (remainder_size < MIN_CHUNK_SIZE) {
+    return;
+  }
+  memory_chunk->size_with_flags -= remainder_size;
+
+  mchunk_t *remainder = get_next_chunk(memory_chunk);
+  remainder->size_with_flags = remainder_size | get_arena_flag(arena);
+  remainder->prev_size = memory_size;
+  get_next_chunk(remainder)->prev_size = remainder_size;
+  add_chunk_to_bin(arena, remainder);
+}
+void merge_chunk_with_top(arena_t *arena, mchunk_t *memory_chunk) {
+  size_t top_size = get_size(arena->top);
+  arena->top = memory_chunk;
+  arena->top->size_with_flags += top_size;
+  update_top_bytes(arena);
+}
+
+void free_sbrk_memory(arena_t *arena, mchunk_t *memory_chunk) {
+  unset_chunks_flag(memory_chunk, IS_INUSE);
+  mchunk_t *coalesced_chunk = coalesce_neighbouring_chunks(arena, memory_chunk);
+
+  mchunk_t *next_chunk = get_next_chunk(coalesced_chunk);
+  unset_chunks_flag(next_chunk, PREV_INUSE);
+
+  // Merge newly coalesced chunk with the top
+  if (next_chunk == arena->top) {
+    merge_chunk_with_top(arena, coalesced_chunk);
+    if (get_size(arena->top) >=
+        __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED)) {
+      trim_top(arena, top_pad);
+    }
+    return;
+  }
+  add_chunk_to_unsorted_bin(arena, coalesced_chunk);
+}
+
+/* Fastbins
+ * Tiny chunks are freed onto singly linked LIFO lists without being
+ * coalesced or having any flags touched, they stay IS_INUSE as far as their
+ * neighbours are concerned. That makes freeing and reusing them O(1). The
+ * price is fragmentation, so the fastbins get consolidated (freed for real)
+ * before a large request or when freed bytes pile up in them.
+ *
+ * The lists are Treiber stacks, so chunks are pushed and popped with a CAS
+ * and no arena lock. Every change of a head bumps the tag packed into its
+ * high bits, which keeps a pop that read a stale head from succeeding after
+ * the same chunk went out and came back in the meantime (ABA). The tag only
+ * has 20 bits, so a pop stalled over a multiple of 2^20 head changes could
+ * still succeed: it bounds ABA rather than ruling it out. A stale head may
+ * also have been coalesced and trimmed away by then, so the heap doesn't
+ * shrink while pops are in flight. Consolidating takes a whole list at once
+ * and still needs the lock.
+ *
+ * The packing assumes 48 bit user addresses. Chunks above them (5-level
+ * paging with mappings past 2^47) don't survive it and skip the fastbins.
+ */
+
+int is_fastbin_size(size_t memory_size) {
+  return memory_size <= fastbin_max_size && memory_size <= FASTBIN_MAX_SIZE;
+}
+
+int is_fastbin_chunk(mchunk_t *memory_chunk) {
+  return is_fastbin_size(get_size(memory_chunk)) &&
+         get_fastbin_chunk(make_fastbin_head(memory_chunk, 0)) == memory_chunk;
+}
+
+int fastbin_index(size_t memory_size) {
+  return memory_size / MEM_ALIGNMENT - 2;
+}
+
+uintptr_t make_fastbin_head(mchunk_t *memory_chunk, uintptr_t previous_head) {
+  return ((uintptr_t)memory_chunk >> FASTBIN_POINTER_SHIFT) |
+         ((previous_head & ~FASTBIN_POINTER_MASK) + FASTBIN_TAG_UNIT);
+}
+
+mchunk_t *get_fastbin_chunk(uintptr_t fastbin_head) {
+  return (mchunk_t *)((fastbin_head & FASTBIN_POINTER_MASK)
+                      << FASTBIN_POINTER_SHIFT);
+}
+
+mchunk_t *get_fastbin_head(arena_t *arena, int fastbin) {
+  return get_fastbin_chunk(
+      __atomic_load_n(&arena->fastbins[fastbin], __ATOMIC_ACQUIRE));
+}
+
+void add_chunk_to_fastbin(arena_t *arena, mchunk_t *memory_chunk) {
+  size_t chunk_size = get_size(memory_chunk);
+  uintptr_t *fastbin = &arena->fastbins[fastbin_index(chunk_size)];
+  uintptr_t head = __atomic_load_n(fastbin, __ATOMIC_RELAXED);
+  do {
+    memory_chunk->fd_chunk = get_fastbin_chunk(head);
+  } while (!__atomic_compare_exchange_n(
+      fastbin, &head, make_fastbin_head(memory_chunk, head), 1,
+      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  __atomic_fetch_add(&arena->fastbin_bytes, chunk_size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&arena->fastbin_chunk_count, 1, __ATOMIC_RELAXED);
+}
+
+mchunk_t *take_chunk_from_fastbin(arena_t *arena, size_t memory_size) {
+  uintptr_t *fastbin = &arena->fastbins[fastbin_index(memory_size)];
+  __atomic_fetch_add(&arena->fastbin_poppers, 1, __ATOMIC_SEQ_CST);
+  uintptr_t head = __atomic_load_n(fastbin, __ATOMIC_SEQ_CST);
+  mchunk_t *memory_chunk;
+  do {
+    memory_chunk = get_fastbin_chunk(head);
+    if (!memory_chunk) {
+      break;
+    }
+  } while (!__atomic_compare_exchange_n(
+      fastbin, &head, make_fastbin_head(memory_chunk->fd_chunk, head), 1,
+      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+  __atomic_fetch_sub(&arena->fastbin_poppers, 1, __ATOMIC_RELEASE);
+  if (memory_chunk) {
+    __atomic_fetch_sub(&arena->fastbin_bytes, memory_size, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&arena->fastbin_chunk_count, 1, __ATOMIC_RELAXED);
+  }
+  return memory_chunk;
+}
+
+void consolidate_fastbins(arena_t *arena) {
+  for (unsigned int i = 0; i < FASTBIN_COUNT; ++i) {
+    uintptr_t head = __atomic_load_n(&arena->fastbins[i], __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&arena->fastbins[i], &head,
+                                        make_fastbin_head(NULL, head), 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    }
+    mchunk_t *memory_chunk = get_fastbin_chunk(head);
+    while (memory_chunk) {
+      mchunk_t *next_chunk = memory_chunk->fd_chunk;
+      __atomic_fetch_sub(&arena->fastbin_bytes, get_size(memory_chunk),
+                         __ATOMIC_RELAXED);
+      __atomic_fetch_sub(&arena->fastbin_chunk_count, 1, __ATOMIC_RELAXED);
+      count_in_use_chunk(arena, -1);
+      free_sbrk_memory(arena, memory_chunk);
+      memory_chunk = next_chunk;
+    }
+  }
+}
+
+/* Slab runs
+ * Requests up to slab_max_size bytes are served from SLAB_RUN_SIZE runs that
+ * hold objects of a single size class and nothing else. Objects carry no
+ * header, a bitmap in the run header tracks the free ones instead, so tiny
+ * objects pack densely and neighbours of one size share cache lines.
+ *
+ * Runs are owned by the heap of a single thread rather than by an arena, so
+ * the owner allocates and frees without any lock. Other threads push the
+ * objects they free onto the run's remote list with a CAS, and the first one
+ * to do so since the owner last looked also queues the run on the owner's
+ * heap. The owner collects all queued runs in one go once a class runs out
+ * of free objects. Both lists are only ever emptied as a whole, with an
+ * atomic exchange, which keeps them safe from ABA. Runs going empty are
+ * handed back to a global list to be reused by any class.
+ *
+ * Slab objects use the same size arithmetic as chunks: a run of N byte
+ * objects serves the requests a chunk of N + CHUNK_HDR_SIZE bytes would, so
+ * both can share the tcache bins.
+ */
+
+int is_slab_size(size_t memory_size) {
+  return memory_size - CHUNK_HDR_SIZE <= slab_max_size &&
+         memory_size - CHUNK_HDR_SIZE <= SLAB_MAX_SIZE;
+}
+
+int slab_class_index(size_t memory_size) {
+  return slab_class_lookup[(memory_size - CHUNK_HDR_SIZE) / MEM_ALIGNMENT - 1];
+}
+
+size_t round_up_to_slab_class(size_t memory_size) {
+  if (!is_slab_size(memory_size)) {
+    return memory_size;
+  }
+  return slab_class_sizes[slab_class_index(memory_size)] + CHUNK_HDR_SIZE;
+}
+
+int is_slab_object(void *payload_ptr) {
+  return get_page_kind(lookup_page(payload_ptr)) == PAGE_SLAB;
+}
+
+slab_run_t *get_slab_run(void *payload_ptr) {
+  return get_page_owner(lookup_page(payload_ptr));
+}
+
+char *get_slab_objects_start(slab_run_t *run) {
+  return (char *)run + align_up_to_multiple_of_16(sizeof(slab_run_t));
+}
+
+void create_thread_heap_key() {
+  pthread_key_create(&thread_heap_key, release_thread_heap);
+}
+
+thread_heap_t *get_thread_heap() {
+  if (thread_heap || thread_heap_shut_down) {
+    return thread_heap;
+  }
+  pthread_mutex_lock(&slab_lock);
+  thread_heap_t *heap = abandoned_thread_heaps;
+  if (heap) {
+    abandoned_thread_heaps = heap->next;
+  }
+  pthread_mutex_unlock(&slab_lock);
+  if (!heap) {
+    heap = mmap(NULL, sizeof(thread_heap_t), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (heap == MAP_FAILED) {
+      return NULL;
+    }
+  }
+  pthread_once(&thread_heap_key_once, create_thread_heap_key);
+  pthread_setspecific(thread_heap_key, heap);
+  thread_heap = heap;
+  return heap;
+}
+
+// The key's destructor gives back the runs that are empty by the time the
+// thread exits, the rest stays with the heap until a new thread adopts it
+void release_thread_heap(void *heap_ptr) {
+  thread_heap_t *heap = heap_ptr;
+  collect_remote_frees(heap);
+  for (int slab_class = 0; slab_class < SLAB_CLASS_COUNT; ++slab_class) {
+    slab_run_t *run = heap->slab_runs[slab_class];
+    while (run) {
+      slab_run_t *next_run = run->next;
+      if (run->free_count == run->capacity) {
+        remove_slab_run(&heap->slab_runs[slab_class], run);
+        release_slab_run(run);
+      }
+      run = next_run;
+    }
+  }
+  thread_heap = NULL;
+  thread_heap_shut_down = 1;
+
+  pthread_mutex_lock(&slab_lock);
+  heap->next = abandoned_thread_heaps;
+  abandoned_thread_heaps = heap;
+  pthread_mutex_unlock(&slab_lock);
+}
+
+// Takes an empty run off the global list, or carves a new one out of the
+// current batch of runs, mapping a new batch when it runs out
+slab_run_t *create_slab_run(thread_heap_t *heap, size_t object_size) {
+  pthread_mutex_lock(&slab_lock);
+  slab_run_t *run = empty_slab_runs;
+  if (run) {
+    empty_slab_runs = run->next;
+  } else {
+    if (!slab_batch_left) {
+      void *batch = mmap(NULL, SLAB_BATCH_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (batch != MAP_FAILED) {
+        slab_batch = batch;
+        slab_batch_left = SLAB_BATCH_SIZE;
+        count_system_memory(&global_stats.slab_mapped_bytes, SLAB_BATCH_SIZE,
+                            NULL);
+      }
+    }
+    uintptr_t run_owner = (uintptr_t)slab_batch | PAGE_SLAB;
+    if (slab_batch_left && map_pages(slab_batch, SLAB_RUN_SIZE, run_owner)) {
+      run = (slab_run_t *)slab_batch;
+      slab_batch += SLAB_RUN_SIZE;
+      slab_batch_left -= SLAB_RUN_SIZE;
+    }
+  }
+  pthread_mutex_unlock(&slab_lock);
+  if (!run) {
+    return NULL;
+  }
+  __atomic_add_fetch(&global_stats.slab_bytes, SLAB_RUN_SIZE, __ATOMIC_RELAXED);
+
+  run->heap = heap;
+  run->next = run->prev = NULL;
+  run->remote_frees = 0;
+  run->remote_next = NULL;
+  run->object_size = object_size;
+  run->capacity =
+      ((char *)run + SLAB_RUN_SIZE - get_slab_objects_start(run)) / object_size;
+  run->free_count = run->capacity;
+  memset(run->free_map, 0, sizeof(run->free_map));
+  for (unsigned int i = 0; i < run->capacity; ++i) {
+    run->free_map[i / BINMAP_WORD_BITS] |= 1ul << (i % BINMAP_WORD_BITS);
+  }
+  return run;
+}
+
+void release_slab_run(slab_run_t *run) {
+  __atomic_sub_fetch(&global_stats.slab_bytes, SLAB_RUN_SIZE, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&slab_lock);
+  run->next = empty_slab_runs;
+  empty_slab_runs = run;
+  pthread_mutex_unlock(&slab_lock);
+}
+
+void add_slab_run(slab_run_t **run_list, slab_run_t *run) {
+  run->prev = NULL;
+  run->next = *run_list;
+  if (run->next) {
+    run->next->prev = run;
+  }
+  *run_list = run;
+}
+
+void remove_slab_run(slab_run_t **run_list, slab_run_t *run) {
+  if (run->prev) {
+    run->prev->next = run->next;
   } else {
-    free_sbrk_memory(memory_chunk);
+    *run_list = run->next;
+  }
+  if (run->next) {
+    run->next->prev = run->prev;
+  }
+  run->next = run->prev = NULL;
+}
+
+void *allocate_from_slab(size_t memory_size) {
+  thread_heap_t *heap = get_thread_heap();
+  if (!heap) {
+    return NULL;
+  }
+  int slab_class = slab_class_index(memory_size);
+  if (!heap->slab_runs[slab_class]) {
+    collect_remote_frees(heap);
+  }
+  slab_run_t *run = heap->slab_runs[slab_class];
+  if (!run) {
+    run = create_slab_run(heap, memory_size - CHUNK_HDR_SIZE);
+    if (!run) {
+      return NULL;
+    }
+    add_slab_run(&heap->slab_runs[slab_class], run);
+  }
+
+  int word = 0;
+  while (!run->free_map[word]) {
+    word++;
+  }
+  int bit = __builtin_ctzl(run->free_map[word]);
+  run->free_map[word] &= ~(1ul << bit);
+  if (--run->free_count == 0) {
+    remove_slab_run(&heap->slab_runs[slab_class], run);
+    add_slab_run(&heap->full_slab_runs, run);
+  }
+  size_t object_index = word * BINMAP_WORD_BITS + bit;
+  return get_slab_objects_start(run) + object_index * run->object_size;
+}
+
+void free_slab_object(void *payload_ptr) {
+  slab_run_t *run = get_slab_run(payload_ptr);
+  if (run->heap == thread_heap) {
+    free_local_slab_object(run->heap, run, payload_ptr);
+  } else {
+    free_remote_slab_object(run, payload_ptr);
+  }
+}
+
+// A run that went empty goes back to the global list, unless it's the last
+// one of its class, which saves the next allocation from fetching it again
+void free_local_slab_object(thread_heap_t *heap, slab_run_t *run,
+                            void *payload_ptr) {
+  size_t object_index =
+      ((char *)payload_ptr - get_slab_objects_start(run)) / run->object_size;
+  run->free_map[object_index / BINMAP_WORD_BITS] |=
+      1ul << (object_index % BINMAP_WORD_BITS);
+
+  int slab_class = slab_class_index(run->object_size + CHUNK_HDR_SIZE);
+  if (run->free_count++ == 0) {
+    remove_slab_run(&heap->full_slab_runs, run);
+    add_slab_run(&heap->slab_runs[slab_class], run);
+    return;
+  }
+  if (run->free_count == run->capacity &&
+      (heap->slab_runs[slab_class] != run || run->next)) {
+    remove_slab_run(&heap->slab_runs[slab_class], run);
+    release_slab_run(run);
+  }
+}
+
+// Whoever sets REMOTE_FREES_QUEUED queues the run, so it's on the heap's
+// remote list at most once
+void free_remote_slab_object(slab_run_t *run, void *payload_ptr) {
+  tcache_entry_t *entry = payload_ptr;
+  uintptr_t remote_frees =
+      __atomic_load_n(&run->remote_frees, __ATOMIC_RELAXED);
+  do {
+    entry->next = (tcache_entry_t *)(remote_frees & ~REMOTE_FREES_QUEUED);
+  } while (!__atomic_compare_exchange_n(
+      &run->remote_frees, &remote_frees,
+      (uintptr_t)entry | REMOTE_FREES_QUEUED, 1, __ATOMIC_RELEASE,
+      __ATOMIC_RELAXED));
+  if (remote_frees & REMOTE_FREES_QUEUED) {
+    return;
+  }
+
+  thread_heap_t *heap = run->heap;
+  run->remote_next = __atomic_load_n(&heap->remote_runs, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&heap->remote_runs, &run->remote_next,
+                                      run, 1, __ATOMIC_RELEASE,
+                                      __ATOMIC_RELAXED)) {
+  }
+}
+
+void collect_remote_frees(thread_heap_t *heap) {
+  if (!__atomic_load_n(&heap->remote_runs, __ATOMIC_RELAXED)) {
+    return;
+  }
+  slab_run_t *run =
+      __atomic_exchange_n(&heap->remote_runs, NULL, __ATOMIC_ACQUIRE);
+  while (run) {
+    // Once the objects are taken the run may get queued again right away
+    slab_run_t *next_run = run->remote_next;
+    tcache_entry_t *entry = (tcache_entry_t *)__atomic_exchange_n(
+        &run->remote_frees, 0, __ATOMIC_ACQUIRE);
+    entry = (tcache_entry_t *)((uintptr_t)entry & ~REMOTE_FREES_QUEUED);
+    while (entry) {
+      tcache_entry_t *next_entry = entry->next;
+      free_local_slab_object(heap, run, entry);
+      entry = next_entry;
+    }
+    run = next_run;
+  }
+}
+
+// Frees a heap chunk into its (locked) arena
+void free_arena_memory(arena_t *arena, mchunk_t *memory_chunk) {
+  if (is_fastbin_chunk(memory_chunk)) {
+    add_chunk_to_fastbin(arena, memory_chunk);
+    if (__atomic_load_n(&arena->fastbin_bytes, __ATOMIC_RELAXED) >
+        FASTBIN_CONSOLIDATION_THRESHOLD) {
+      consolidate_fastbins(arena);
+    }
+    return;
+  }
+  count_in_use_chunk(arena, -1);
+  free_sbrk_memory(arena, memory_chunk);
+}
+
+// Big chunks get a private page-rounded mapping, so they never fragment the
+// sbrk heap and their pages go straight back to the kernel on free
+void *allocate_with_mmap(size_t memory_size) {
+  size_t page_size = get_page_size();
+  size_t mapping_size = (memory_size + page_size - 1) / page_size * page_size;
+  void *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+
+  if (!map_pages(mapping, mapping_size, (uintptr_t)mapping | PAGE_MMAP)) {
+    munmap(mapping, mapping_size);
+    return NULL;
+  }
+
+  count_system_memory(&global_stats.mmap_bytes, mapping_size,
+                      &global_stats.peak_mmap_bytes);
+  __atomic_add_fetch(&global_stats.mmap_chunk_count, 1, __ATOMIC_RELAXED);
+  mchunk_t *memory_chunk = (mchunk_t *)mapping;
+  memory_chunk->prev_size = 0;
+  memory_chunk->size_with_flags = mapping_size;
+  set_chunks_flag(memory_chunk, IS_MMAP | IS_INUSE);
+  return mchunk_into_payload(memory_chunk);
+}
+
+void set_mmap_threshold(size_t threshold) {
+  __atomic_store_n(&mmap_threshold_is_set, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&mmap_threshold, threshold, __ATOMIC_RELAXED);
+}
+
+void set_trim_threshold(size_t threshold) {
+  __atomic_store_n(&trim_threshold_is_set, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&trim_threshold, threshold, __ATOMIC_RELAXED);
+}
+
+/* Adaptive threshold, as in dlmalloc/glibc: a freed mapping bigger than the
+ * current threshold means blocks of that size are short-lived, so the next
+ * ones are cheaper to serve from the heap than with a fresh mmap()/munmap()
+ * pair. Huge blocks (above MMAP_THRESHOLD_MAX) always stay mapped. The trim
+ * threshold follows, so the top doesn't get trimmed right under such blocks.
+ * A threshold set with its setter is left alone from then on. Racing frees
+ * may store their sizes in any order, the threshold is only a hint.
+ */
+void free_mmap_memory(mchunk_t *memory_chunk) {
+  size_t chunk_size = get_size(memory_chunk);
+  if (!__atomic_load_n(&mmap_threshold_is_set, __ATOMIC_RELAXED) &&
+      chunk_size > __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) &&
+      chunk_size <= MMAP_THRESHOLD_MAX) {
+    __atomic_store_n(&mmap_threshold, chunk_size, __ATOMIC_RELAXED);
+    if (!__atomic_load_n(&trim_threshold_is_set, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&trim_threshold, 2 * chunk_size, __ATOMIC_RELAXED);
+    }
+  }
+  // Aligned chunks may start past the beginning of their mapping, prev_size
+  // holds how far
+  char *mapping = (char *)memory_chunk - memory_chunk->prev_size;
+  size_t mapping_size = chunk_size + memory_chunk->prev_size;
+  map_pages(mapping, mapping_size, 0);
+  munmap(mapping, mapping_size);
+  count_system_memory(&global_stats.mmap_bytes, -(ptrdiff_t)mapping_size, NULL);
+  __atomic_sub_fetch(&global_stats.mmap_chunk_count, 1, __ATOMIC_RELAXED);
+}
+
+mchunk_t *find_free_chunk(arena_t *arena, size_t memory_size) {
+  // Large requests are the ones fragmentation hurts, so they see the
+  // fastbins consolidated
+  if (memory_size > SMALL_BIN_MAX &&
+      __atomic_load_n(&arena->fastbin_bytes, __ATOMIC_RELAXED)) {
+    consolidate_fastbins(arena);
+  }
+
+  // Check the unsorted chunks for an exact fit, then the bins for the best
+  // one
+  mchunk_t *memory_chunk = sort_unsorted_bin(arena, memory_size);
+  if (!memory_chunk) {
+    memory_chunk = find_and_remove_chunk_from_bin(arena, memory_size);
+  }
+  return memory_chunk;
+}
+
+void *allocate_with_sbrk(arena_t *arena, size_t memory_size) {
+  void *memory_ptr;
+  // Tiny chunks are popped off the fastbins as they are, still marked in use
+  if (is_fastbin_size(memory_size)) {
+    mchunk_t *fast_chunk = take_chunk_from_fastbin(arena, memory_size);
+    if (fast_chunk) {
+      return mchunk_into_payload(fast_chunk);
+    }
+  }
+
+  mchunk_t *memory_chunk = find_free_chunk(arena, memory_size);
+
+  // Before growing the heap let the fastbins coalesce, they may be all that
+  // is keeping a fitting chunk from forming
+  if (!memory_chunk &&
+      __atomic_load_n(&arena->fastbin_bytes, __ATOMIC_RELAXED) &&
+      arena->top &&
+      is_top_too_small(arena, memory_size)) {
+    consolidate_fastbins(arena);
+    memory_chunk = find_free_chunk(arena, memory_size);
+  }
+
+  // Set appropriate flags for the found chunk and its neighbour
+  if (memory_chunk) {
+    split_chunk(arena, memory_chunk, memory_size);
+    set_chunks_flag(memory_chunk, IS_INUSE);
+    mchunk_t *following = get_next_chunk(memory_chunk);
+    set_chunks_flag(following, PREV_INUSE);
+    count_in_use_chunk(arena, 1);
+    memory_ptr = mchunk_into_payload(memory_chunk);
+    return memory_ptr;
+  }
+
+  // Check whether top exists and if it's big enough
+  if (!arena->top) {
+    void *creation_result = create_top(arena);
+    if (creation_result == SBRK_ERR) {
+      return NULL;
+    }
+  }
+  if (is_top_too_small(arena, memory_size)) {
+    void *extension_result = extend_top(arena, memory_size);
+    if (extension_result == SBRK_ERR) {
+      return NULL;
+    }
+  }
+
+  // Slice a chunk off top
+  memory_ptr = create_chunk_and_return_payloads_pointer(arena, memory_size);
+  count_in_use_chunk(arena, 1);
+  return memory_ptr;
+}
+
+/* Thread-local cache
+ * Every thread keeps short LIFO lists of recently freed small chunks, one per
+ * chunk size. Cached chunks stay marked as IS_INUSE, so from the heaps point
+ * of view they are still allocated and nothing coalesces with them. Hitting
+ * the cache is a pointer pop without taking the heap lock; a full list is
+ * flushed back to the heap in one batch under a single lock acquisition.
+ */
+
+int tcache_bin_index(size_t memory_size) {
+  return memory_size / MEM_ALIGNMENT;
+}
+
+// The key's value is this thread's own tcache, which tcache_flush() works on
+void tcache_thread_shutdown(void *thread_tcache) {
+  (void)thread_tcache;
+  tcache_flush();
+  tcache_state = TCACHE_SHUT_DOWN;
+}
+
+void create_tcache_key() {
+  pthread_key_create(&tcache_key, tcache_thread_shutdown);
+}
+
+// The key's destructor hands cached chunks back to the heap on thread exit
+void register_tcache() {
+  pthread_once(&tcache_key_once, create_tcache_key);
+  pthread_setspecific(tcache_key, &tcache);
+  tcache_state = TCACHE_ACTIVE;
+}
+
+void *tcache_get(size_t memory_size) {
+  if (memory_size > TCACHE_MAX_SIZE) {
+    return NULL;
+  }
+  int tcache_bin = tcache_bin_index(memory_size);
+  tcache_entry_t *entry = tcache.entries[tcache_bin];
+  if (!entry) {
+    return NULL;
+  }
+  tcache.entries[tcache_bin] = entry->next;
+  tcache.counts[tcache_bin]--;
+  return entry;
+}
+
+// Takes heap chunks and slab objects alike, by payload and the chunk size
+// they stand for
+int tcache_put(void *payload_ptr, size_t chunk_size) {
+  if (chunk_size > TCACHE_MAX_SIZE || tcache_count == 0 ||
+      tcache_state == TCACHE_SHUT_DOWN) {
+    return 0;
+  }
+  if (tcache_state == TCACHE_UNREGISTERED) {
+    register_tcache();
+  }
+
+  int tcache_bin = tcache_bin_index(chunk_size);
+  if (tcache.counts[tcache_bin] >= tcache_count) {
+    tcache_flush_bin(tcache_bin, (tcache.counts[tcache_bin] + 1) / 2);
+  }
+
+  tcache_entry_t *entry = payload_ptr;
+  entry->next = tcache.entries[tcache_bin];
+  tcache.entries[tcache_bin] = entry;
+  tcache.counts[tcache_bin]++;
+  return 1;
+}
+
+// Chunks usually come from the same arena, so its lock is only switched when
+// the owner changes
+void tcache_flush_bin(int tcache_bin, unsigned int entries_to_flush) {
+  arena_t *locked_arena = NULL;
+  while (entries_to_flush-- && tcache.entries[tcache_bin]) {
+    tcache_entry_t *entry = tcache.entries[tcache_bin];
+    tcache.entries[tcache_bin] = entry->next;
+    tcache.counts[tcache_bin]--;
+
+    // Emptying a run takes slab_lock, the arena lock is let go first so the
+    // two never nest
+    if (is_slab_object(entry)) {
+      if (locked_arena) {
+        pthread_mutex_unlock(&locked_arena->lock);
+        locked_arena = NULL;
+      }
+      free_slab_object(entry);
+      continue;
+    }
+    arena_t *arena = get_payload_arena(entry);
+    if (arena != locked_arena) {
+      if (locked_arena) {
+        pthread_mutex_unlock(&locked_arena->lock);
+      }
+      pthread_mutex_lock(&arena->lock);
+      locked_arena = arena;
+    }
+    free_arena_memory(arena, payload_into_mchunk(entry));
+  }
+  if (locked_arena) {
+    pthread_mutex_unlock(&locked_arena->lock);
+  }
+}
+
+void tcache_flush() {
+  for (unsigned int i = 0; i < TCACHE_BIN_COUNT; ++i) {
+    tcache_flush_bin(i, tcache.counts[i]);
+  }
+}
+
+/* Per-CPU cache
+ * The same kind of lists as the thread-local cache, but one set per CPU, so
+ * the cached memory grows with the cores instead of the threads. Pushes and
+ * pops are restartable sequences: the kernel restarts them at the abort
+ * handler if the thread gets preempted, migrated or signalled before the
+ * final store to the count, so no atomics are needed. The cache stays off
+ * where libc doesn't register rseq areas for its threads.
+ */
+
+void create_percpu_caches() {
+  size_t cpus = sysconf(_SC_NPROCESSORS_CONF);
+  void *caches = mmap(NULL, cpus * sizeof(percpu_cache_t),
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                      0);
+  if (caches != MAP_FAILED) {
+    percpu_caches = caches;
+    percpu_cache_cpus = cpus;
+  }
+}
+
+#ifdef HAVE_RSEQ
+struct rseq *get_rseq_area() {
+  return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+int get_current_cpu() {
+  if (__rseq_size == 0) {
+    return -1;
+  }
+  return (int)__atomic_load_n(&get_rseq_area()->cpu_id, __ATOMIC_RELAXED);
+}
+
+/* The descriptor is emitted into the __rseq_cs section, and the abort
+ * handler into __rseq_failure behind the signature the kernel checks before
+ * jumping to it. Everything up to label 2 restarts as a whole.
+ */
+#define RSEQ_CRITICAL_SECTION(body)                                           \
+  ".pushsection __rseq_cs, \"aw\"\n\t"                                        \
+  ".balign 32\n\t"                                                            \
+  "3:\n\t"                                                                    \
+  ".long 0x0, 0x0\n\t"                                                        \
+  ".quad 1f, (2f - 1f), 4f\n\t"                                               \
+  ".popsection\n\t"                                                           \
+  "leaq 3b(%%rip), %%rax\n\t"                                                 \
+  "movq %%rax, %[rseq_cs]\n\t"                                                \
+  "1:\n\t"                                                                    \
+  "cmpl %[cpu], %[cpu_id]\n\t"                                                \
+  "jnz %l[aborted]\n\t" body "2:\n\t"                                         \
+  ".pushsection __rseq_failure, \"ax\"\n\t"                                   \
+  ".byte 0x0f, 0xb9, 0x3d\n\t"                                                \
+  ".long 0x53053053\n\t"                                                      \
+  "4:\n\t"                                                                    \
+  "jmp %l[aborted]\n\t"                                                       \
+  ".popsection\n\t"
+
+int percpu_cache_pop_slot(unsigned int *count, void **slots, int cpu,
+                          void **payload_ptr) {
+  struct rseq *rseq_area = get_rseq_area();
+  __asm__ __volatile__ goto(
+      RSEQ_CRITICAL_SECTION("movl (%[count]), %%ecx\n\t"
+                            "testl %%ecx, %%ecx\n\t"
+                            "jz %l[empty]\n\t"
+                            "movq -8(%[slots], %%rcx, 8), %%rdx\n\t"
+                            "movq %%rdx, (%[payload_ptr])\n\t"
+                            "decl %%ecx\n\t"
+                            "movl %%ecx, (%[count])\n\t")
+      :
+      : [rseq_cs] "m"(rseq_area->rseq_cs), [cpu_id] "m"(rseq_area->cpu_id),
+        [cpu] "r"(cpu), [count] "r"(count), [slots] "r"(slots),
+        [payload_ptr] "r"(payload_ptr)
+      : "memory", "cc", "rax", "rcx", "rdx"
+      : empty, aborted);
+  return 1;
+empty:
+  return 0;
+aborted:
+  return -1;
+}
+
+int percpu_cache_push_slot(unsigned int *count, void **slots,
+                           unsigned int limit, int cpu, void *payload_ptr) {
+  struct rseq *rseq_area = get_rseq_area();
+  __asm__ __volatile__ goto(
+      RSEQ_CRITICAL_SECTION("movl (%[count]), %%ecx\n\t"
+                            "cmpl %[limit], %%ecx\n\t"
+                            "jae %l[full]\n\t"
+                            "movq %[payload_ptr], (%[slots], %%rcx, 8)\n\t"
+                            "incl %%ecx\n\t"
+                            "movl %%ecx, (%[count])\n\t")
+      :
+      : [rseq_cs] "m"(rseq_area->rseq_cs), [cpu_id] "m"(rseq_area->cpu_id),
+        [cpu] "r"(cpu), [count] "r"(count), [slots] "r"(slots),
+        [limit] "r"(limit), [payload_ptr] "r"(payload_ptr)
+      : "memory", "cc", "rax", "rcx"
+      : full, aborted);
+  return 1;
+full:
+  return 0;
+aborted:
+  return -1;
+}
+#else
+int get_current_cpu() { return -1; }
+
+int percpu_cache_pop_slot(unsigned int *count, void **slots, int cpu,
+                          void **payload_ptr) {
+  (void)count;
+  (void)slots;
+  (void)cpu;
+  (void)payload_ptr;
+  return 0;
+}
+
+int percpu_cache_push_slot(unsigned int *count, void **slots,
+                           unsigned int limit, int cpu, void *payload_ptr) {
+  (void)count;
+  (void)slots;
+  (void)limit;
+  (void)cpu;
+  (void)payload_ptr;
+  return 0;
+}
+#endif
+
+int percpu_cache_available() {
+  if (get_current_cpu() < 0) {
+    return 0;
+  }
+  pthread_once(&percpu_caches_once, create_percpu_caches);
+  return percpu_caches != NULL;
+}
+
+// An aborted sequence did nothing, it's retried on whatever CPU the thread
+// ended up on
+void *percpu_cache_get(size_t memory_size) {
+  if (memory_size > PERCPU_CACHE_MAX_SIZE || percpu_cache_count == 0 ||
+      !percpu_cache_available()) {
+    return NULL;
+  }
+  int percpu_bin = memory_size / MEM_ALIGNMENT;
+  void *payload_ptr;
+  int result;
+  do {
+    int cpu = get_current_cpu();
+    percpu_cache_t *cache = &percpu_caches[cpu];
+    result = percpu_cache_pop_slot(&cache->counts[percpu_bin],
+                                   cache->slots[percpu_bin], cpu, &payload_ptr);
+  } while (result < 0);
+  return result ? payload_ptr : NULL;
+}
+
+// A full stack isn't flushed, the chunk simply goes back to the heap
+int percpu_cache_put(void *payload_ptr, size_t chunk_size) {
+  if (chunk_size > PERCPU_CACHE_MAX_SIZE || percpu_cache_count == 0 ||
+      !percpu_cache_available()) {
+    return 0;
+  }
+  unsigned int limit = percpu_cache_count < PERCPU_CACHE_SLOTS
+                           ? percpu_cache_count
+                           : PERCPU_CACHE_SLOTS;
+  int percpu_bin = chunk_size / MEM_ALIGNMENT;
+  int result;
+  do {
+    int cpu = get_current_cpu();
+    percpu_cache_t *cache = &percpu_caches[cpu];
+    result = percpu_cache_push_slot(&cache->counts[percpu_bin],
+                                    cache->slots[percpu_bin], limit, cpu,
+                                    payload_ptr);
+  } while (result < 0);
+  return result;
+}
+
+void percpu_cache_flush() {
+  if (!percpu_cache_available()) {
+    return;
+  }
+  for (unsigned int i = 0; i < PERCPU_CACHE_BIN_COUNT; ++i) {
+    void *payload_ptr;
+    int result;
+    do {
+      int cpu = get_current_cpu();
+      percpu_cache_t *cache = &percpu_caches[cpu];
+      result = percpu_cache_pop_slot(&cache->counts[i], cache->slots[i], cpu,
+                                     &payload_ptr);
+      if (result <= 0) {
+        continue;
+      }
+      if (is_slab_object(payload_ptr)) {
+        free_slab_object(payload_ptr);
+        continue;
+      }
+      arena_t *arena = get_payload_arena(payload_ptr);
+      pthread_mutex_lock(&arena->lock);
+      free_arena_memory(arena, payload_into_mchunk(payload_ptr));
+      pthread_mutex_unlock(&arena->lock);
+    } while (result != 0);
   }
 }
 
-void *allocate(size_t size) {
+arena_t *get_payload_arena(void *payload_ptr) {
+  return get_page_owner(lookup_page(payload_ptr));
+}
+
+// The page map tells what the pointer is, pointers it doesn't know were
+// never handed out by us and are left alone
+void free_memory_untraced(void *payload_ptr) {
+  if (!payload_ptr)
+    return;
+  uintptr_t page_owner = lookup_page(payload_ptr);
+  switch (get_page_kind(page_owner)) {
+  case PAGE_SLAB: {
+    slab_run_t *run = get_page_owner(page_owner);
+    size_t chunk_size = run->object_size + CHUNK_HDR_SIZE;
+    if (!tcache_put(payload_ptr, chunk_size) &&
+        !percpu_cache_put(payload_ptr, chunk_size)) {
+      free_slab_object(payload_ptr);
+    }
+    return;
+  }
+  case PAGE_MMAP:
+    if (__atomic_load_n(&profile_sample_count, __ATOMIC_RELAXED)) {
+      drop_sample(payload_ptr);
+    }
+    free_mmap_memory(payload_into_mchunk(payload_ptr));
+    return;
+  case PAGE_HEAP: {
+    mchunk_t *memory_chunk = payload_into_mchunk(payload_ptr);
+    size_t chunk_size = get_size(memory_chunk);
+    if (tcache_put(payload_ptr, chunk_size) ||
+        percpu_cache_put(payload_ptr, chunk_size)) {
+      return;
+    }
+    arena_t *arena = get_page_owner(page_owner);
+    // Fastbins take chunks without the lock, it's only needed once they're
+    // due for consolidation
+    if (is_fastbin_chunk(memory_chunk)) {
+      add_chunk_to_fastbin(arena, memory_chunk);
+      if (__atomic_load_n(&arena->fastbin_bytes, __ATOMIC_RELAXED) <=
+          FASTBIN_CONSOLIDATION_THRESHOLD) {
+        return;
+      }
+      pthread_mutex_lock(&arena->lock);
+      consolidate_fastbins(arena);
+    } else {
+      pthread_mutex_lock(&arena->lock);
+      free_arena_memory(arena, memory_chunk);
+    }
+    pthread_mutex_unlock(&arena->lock);
+    return;
+  }
+  default:
+    return;
+  }
+}
+
+void *allocate_untraced(size_t size) {
   void *result_ptr;
-  size_t memory_size = calculate_aligned_memory(size);
-  if (memory_size > MMAP_THRESHOLD) {
+  if (size > PTRDIFF_MAX) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  size_t memory_size = round_up_to_slab_class(calculate_aligned_memory(size));
+  result_ptr = tcache_get(memory_size);
+  if (!result_ptr) {
+    result_ptr = percpu_cache_get(memory_size);
+  }
+  if (result_ptr) {
+    return result_ptr;
+  }
+  if (memory_size > __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+    return allocate_with_mmap(memory_size);
+  }
+
+  if (is_slab_size(memory_size)) {
+    result_ptr = allocate_from_slab(memory_size);
+    if (result_ptr) {
+      return result_ptr;
+    }
+  }
+  if (is_fastbin_size(memory_size)) {
+    mchunk_t *fast_chunk =
+        take_chunk_from_fastbin(get_thread_arena(), memory_size);
+    if (fast_chunk) {
+      return mchunk_into_payload(fast_chunk);
+    }
+  }
+
+  arena_t *arena = lock_thread_arena();
+  result_ptr = allocate_with_sbrk(arena, memory_size);
+  pthread_mutex_unlock(&arena->lock);
+
+  // The arena couldn't grow, a mapping may still be possible
+  if (!result_ptr) {
     result_ptr = allocate_with_mmap(memory_size);
-  } else {
-    result_ptr = allocate_with_sbrk(memory_size);
   }
   return result_ptr;
 }
+
+/* Memory straight from the kernel is already zero, so only the part of the
+ * chunk that was used before gets cleared. Mappings are always fresh. A
+ * chunk sliced off the top is fresh from where the untouched memory started,
+ * which also covers a top that moved up to new memory for it. Chunks reused
+ * from the caches or the bins get cleared completely.
+ */
+void *allocate_zeroed_untraced(size_t count, size_t size) {
+  size_t total_size;
+  if (__builtin_mul_overflow(count, size, &total_size) ||
+      total_size > PTRDIFF_MAX) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  size_t memory_size =
+      round_up_to_slab_class(calculate_aligned_memory(total_size));
+  void *payload_ptr = tcache_get(memory_size);
+  if (!payload_ptr) {
+    payload_ptr = percpu_cache_get(memory_size);
+  }
+  if (payload_ptr) {
+    memset(payload_ptr, 0, total_size);
+    return payload_ptr;
+  }
+  if (memory_size > __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+    return allocate_with_mmap(memory_size);
+  }
+
+  if (is_slab_size(memory_size)) {
+    payload_ptr = allocate_from_slab(memory_size);
+    if (payload_ptr) {
+      memset(payload_ptr, 0, total_size);
+      return payload_ptr;
+    }
+  }
+  if (is_fastbin_size(memory_size)) {
+    mchunk_t *fast_chunk =
+        take_chunk_from_fastbin(get_thread_arena(), memory_size);
+    if (fast_chunk) {
+      payload_ptr = mchunk_into_payload(fast_chunk);
+      memset(payload_ptr, 0, total_size);
+      return payload_ptr;
+    }
+  }
+
+  arena_t *arena = lock_thread_arena();
+  char *untouched_start = arena->untouched_start;
+  payload_ptr = allocate_with_sbrk(arena, memory_size);
+  size_t dirty_size = total_size;
+  // Fastbin chunks stay in use, so they may border the top without having
+  // been sliced off it. The top may also have merged with freed chunks in the
+  // meantime, which only ever moves it below the untouched memory.
+  if (payload_ptr && memory_size > FASTBIN_MAX_SIZE &&
+      get_next_chunk(payload_into_mchunk(payload_ptr)) == arena->top) {
+    if ((char *)payload_ptr >= untouched_start) {
+      dirty_size = 0;
+    } else if ((char *)payload_ptr + total_size > untouched_start) {
+      dirty_size = untouched_start - (char *)payload_ptr;
+    }
+  }
+  pthread_mutex_unlock(&arena->lock);
+
+  if (!payload_ptr) {
+    return allocate_with_mmap(memory_size);
+  }
+  memset(payload_ptr, 0, dirty_size);
+  return payload_ptr;
+}
+
+size_t get_usable_size(void *payload_ptr) {
+  if (!payload_ptr) {
+    return 0;
+  }
+  if (is_slab_object(payload_ptr)) {
+    return get_slab_run(payload_ptr)->object_size;
+  }
+  return get_size(payload_into_mchunk(payload_ptr)) - CHUNK_HDR_SIZE;
+}
+
+// Frees the part of an in-use heap chunk past memory_size, when it's big
+// enough to be a chunk on its own. The tail coalesces like any freed chunk.
+void free_chunk_tail(arena_t *arena, mchunk_t *memory_chunk,
+                     size_t memory_size) {
+  size_t tail_size = get_size(memory_chunk) - memory_size;
+  if (tail_size < MIN_CHUNK_SIZE) {
+    return;
+  }
+  memory_chunk->size_with_flags -= tail_size;
+
+  mchunk_t *tail = get_next_chunk(memory_chunk);
+  tail->size_with_flags =
+      tail_size | PREV_INUSE | IS_INUSE | get_arena_flag(arena);
+  tail->prev_size = memory_size;
+  free_sbrk_memory(arena, tail);
+}
+
+/* Tries to make an in-use heap chunk memory_size bytes big without moving
+ * it, by taking the following chunk when it's free or the top. Whatever the
+ * chunk ends up with beyond memory_size is freed again.
+ */
+int grow_chunk_in_place(arena_t *arena, mchunk_t *memory_chunk,
+                        size_t memory_size) {
+  size_t chunk_size = get_size(memory_chunk);
+  mchunk_t *next_chunk = get_next_chunk(memory_chunk);
+
+  if (next_chunk == arena->top) {
+    size_t missing_size = memory_size - chunk_size;
+    if (is_top_too_small(arena, missing_size) &&
+        extend_top(arena, missing_size) == SBRK_ERR) {
+      return 0;
+    }
+    // Growing may have started a new top somewhere else
+    if (next_chunk != arena->top) {
+      return 0;
+    }
+    size_t top_size = get_size(next_chunk);
+    memory_chunk->size_with_flags += missing_size;
+
+    mchunk_t *top = get_next_chunk(memory_chunk);
+    top->size_with_flags = top_size - missing_size;
+    top->prev_size = memory_size;
+    set_chunks_flag(top, PREV_INUSE | get_arena_flag(arena));
+    arena->top = top;
+    if ((char *)top + CHUNK_HDR_SIZE > (char *)arena->untouched_start) {
+      arena->untouched_start = (char *)top + CHUNK_HDR_SIZE;
+    }
+    update_top_bytes(arena);
+    return 1;
+  }
+
+  if (is_in_use(next_chunk) ||
+      chunk_size + get_size(next_chunk) < memory_size) {
+    return 0;
+  }
+  remove_from_bin(arena, next_chunk);
+  memory_chunk->size_with_flags += get_size(next_chunk);
+  mchunk_t *following = get_next_chunk(memory_chunk);
+  following->prev_size = get_size(memory_chunk);
+  set_chunks_flag(following, PREV_INUSE);
+  free_chunk_tail(arena, memory_chunk, memory_size);
+  return 1;
+}
+
+/* Moves a mapping into a fresh one of mapping_size bytes, which is entered
+ * into the page map before anything moves, so a failing page map leaves the
+ * old mapping where it was. Returns NULL in that case or if the kernel
+ * refused.
+ */
+char *move_mapping(char *old_mapping, size_t old_mapping_size,
+                   size_t mapping_size) {
+  char *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+  if (map_pages(mapping, mapping_size, (uintptr_t)mapping | PAGE_MMAP) &&
+      mremap(old_mapping, old_mapping_size, mapping_size,
+             MREMAP_MAYMOVE | MREMAP_FIXED, mapping) != MAP_FAILED) {
+    return mapping;
+  }
+  map_pages(mapping, mapping_size, 0);
+  munmap(mapping, mapping_size);
+  return NULL;
+}
+
+/* Resizes the mapping behind a mapped chunk, moving it when it can't grow
+ * where it is. The payload keeps its offset into the mapping, but not
+ * necessarily a bigger alignment it was created with. Returns NULL, with the
+ * chunk untouched, if the kernel or the page map refused.
+ */
+mchunk_t *remap_chunk(mchunk_t *memory_chunk, size_t memory_size) {
+  size_t page_size = get_page_size();
+  size_t offset = memory_chunk->prev_size;
+  size_t old_mapping_size = get_size(memory_chunk) + offset;
+  size_t mapping_size =
+      (memory_size + offset + page_size - 1) / page_size * page_size;
+  if (mapping_size == old_mapping_size) {
+    return memory_chunk;
+  }
+
+  // Once mremap() returns, another thread may already have mapped the pages
+  // it gave up, so they have to leave the page map before
+  char *mapping = (char *)memory_chunk - offset;
+  uintptr_t owner = (uintptr_t)mapping | PAGE_MMAP;
+  map_pages(mapping, old_mapping_size, 0);
+  if (mremap(mapping, old_mapping_size, mapping_size, 0) != MAP_FAILED) {
+    // Shrinking back in place can't fail, and the old pages are known
+    if (!map_pages(mapping, mapping_size, owner)) {
+      map_pages(mapping, mapping_size, 0);
+      mremap(mapping, mapping_size, old_mapping_size, 0);
+      map_pages(mapping, old_mapping_size, owner);
+      return NULL;
+    }
+  } else {
+    char *old_mapping = mapping;
+    mapping = move_mapping(old_mapping, old_mapping_size, mapping_size);
+    if (!mapping) {
+      map_pages(old_mapping, old_mapping_size, owner);
+      return NULL;
+    }
+  }
+  count_system_memory(&global_stats.mmap_bytes,
+                      (ptrdiff_t)mapping_size - (ptrdiff_t)old_mapping_size,
+                      &global_stats.peak_mmap_bytes);
+  memory_chunk = (mchunk_t *)(mapping + offset);
+  memory_chunk->size_with_flags = (mapping_size - offset) | IS_MMAP | IS_INUSE;
+  return memory_chunk;
+}
+
+/* Resizing only copies when it can't be done in place:
+ *  1.  Mapped chunks get their mapping resized with mremap()
+ *  2.  Shrinking heap chunks give their tail back to the heap
+ *  3.  Growing heap chunks take the free chunk or the top after them
+ */
+void *reallocate_untraced(void *payload_ptr, size_t size) {
+  if (!payload_ptr) {
+    return allocate_untraced(size);
+  }
+  if (size == 0) {
+    free_memory_untraced(payload_ptr);
+    return NULL;
+  }
+  if (size > PTRDIFF_MAX) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  mchunk_t *memory_chunk = payload_into_mchunk(payload_ptr);
+  size_t memory_size = calculate_aligned_memory(size);
+
+  if (is_slab_object(payload_ptr)) {
+    // Objects can't change class, they only stay put while they fit
+    if (size <= get_usable_size(payload_ptr)) {
+      return payload_ptr;
+    }
+  } else if (is_chunk_mmaped(memory_chunk)) {
+    profile_sample_t *sample = NULL;
+    if (__atomic_load_n(&profile_sample_count, __ATOMIC_RELAXED)) {
+      sample = take_sample(payload_ptr);
+    }
+    mchunk_t *remapped_chunk = remap_chunk(memory_chunk, memory_size);
+    if (sample && remapped_chunk) {
+      put_sample(sample, mchunk_into_payload(remapped_chunk), size);
+    } else if (sample) {
+      put_sample(sample, payload_ptr, sample->size);
+    }
+    if (remapped_chunk) {
+      return mchunk_into_payload(remapped_chunk);
+    }
+  } else {
+    arena_t *arena = chunk_arena(memory_chunk);
+    int is_resized = 1;
+    pthread_mutex_lock(&arena->lock);
+    if (memory_size <= get_size(memory_chunk)) {
+      free_chunk_tail(arena, memory_chunk, memory_size);
+    } else {
+      is_resized = grow_chunk_in_place(arena, memory_chunk, memory_size);
+    }
+    pthread_mutex_unlock(&arena->lock);
+    if (is_resized) {
+      return payload_ptr;
+    }
+  }
+
+  void *new_payload_ptr = allocate_untraced(size);
+  if (!new_payload_ptr) {
+    return NULL;
+  }
+  size_t usable_size = get_usable_size(payload_ptr);
+  memcpy(new_payload_ptr, payload_ptr, size < usable_size ? size : usable_size);
+  free_memory_untraced(payload_ptr);
+  return new_payload_ptr;
+}
+
+/* Aligned allocations over-allocate by the alignment plus a minimal chunk,
+ * then move the chunk up to the first aligned payload. The gap in front is
+ * freed as a chunk of its own, and so is whatever is left past the request.
+ * Mapped chunks can't give the gap back, they record it in prev_size
+ * instead so the whole mapping gets unmapped on free.
+ */
+void *allocate_aligned_untraced(size_t alignment, size_t size) {
+  if (alignment <= MEM_ALIGNMENT) {
+    return allocate_untraced(size);
+  }
+  // Like memalign(), round odd alignments up to a power of two
+  if (alignment & (alignment - 1)) {
+    if (alignment > PTRDIFF_MAX / 2) {
+      errno = EINVAL;
+      return NULL;
+    }
+    alignment = (size_t)1 << (8 * sizeof(size_t) -
+                              __builtin_clzl((unsigned long)alignment));
+  }
+  if (size > PTRDIFF_MAX - alignment - MIN_CHUNK_SIZE) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  size_t memory_size = calculate_aligned_memory(size);
+  size_t padded_size = memory_size + alignment + MIN_CHUNK_SIZE;
+  arena_t *arena = NULL;
+  void *payload_ptr = NULL;
+  if (padded_size <= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+    arena = lock_thread_arena();
+    payload_ptr = allocate_with_sbrk(arena, padded_size);
+    if (!payload_ptr) {
+      pthread_mutex_unlock(&arena->lock);
+      arena = NULL;
+    }
+  }
+  if (!payload_ptr) {
+    payload_ptr = allocate_with_mmap(padded_size);
+    if (!payload_ptr) {
+      return NULL;
+    }
+  }
+
+  mchunk_t *memory_chunk = payload_into_mchunk(payload_ptr);
+  uintptr_t aligned_payload =
+      ((uintptr_t)payload_ptr + alignment - 1) & ~(uintptr_t)(alignment - 1);
+  size_t gap_size = aligned_payload - (uintptr_t)payload_ptr;
+  // A heap gap has to hold a chunk
+  if (arena && gap_size && gap_size < MIN_CHUNK_SIZE) {
+    gap_size += alignment;
+  }
+
+  if (gap_size) {
+    mchunk_t *aligned_chunk = (mchunk_t *)((char *)memory_chunk + gap_size);
+    size_t aligned_chunk_size = get_size(memory_chunk) - gap_size;
+    if (!arena) {
+      aligned_chunk->prev_size = memory_chunk->prev_size + gap_size;
+      aligned_chunk->size_with_flags =
+          aligned_chunk_size | IS_MMAP | IS_INUSE;
+      return mchunk_into_payload(aligned_chunk);
+    }
+    aligned_chunk->size_with_flags =
+        aligned_chunk_size | IS_INUSE | get_arena_flag(arena);
+    aligned_chunk->prev_size = gap_size;
+    memory_chunk->size_with_flags -= aligned_chunk_size;
+    free_sbrk_memory(arena, memory_chunk);
+    memory_chunk = aligned_chunk;
+  }
+
+  if (arena) {
+    free_chunk_tail(arena, memory_chunk, memory_size);
+    pthread_mutex_unlock(&arena->lock);
+  }
+  return mchunk_into_payload(memory_chunk);
+}
+
+int allocate_aligned_checked(void **payload_ptr, size_t alignment,
+                             size_t size) {
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1))) {
+    return EINVAL;
+  }
+  void *aligned_ptr = allocate_aligned(alignment, size);
+  if (!aligned_ptr) {
+    return ENOMEM;
+  }
+  *payload_ptr = aligned_ptr;
+  return 0;
+}
+
+/* Allocation tracing
+ * Every call of the entry points appends a record to a ring in a shared file
+ * mapping, so the trace survives the process and costs no system calls. The
+ * slot is claimed before the record is written, a reader racing the writers
+ * may see the newest records half written. Pointers are recorded as they
+ * were, replaying matches frees to allocations by address.
+ */
+
+int trace_start(const char *path, size_t record_count) {
+  size_t file_size;
+  if (tracing || record_count == 0 ||
+      __builtin_mul_overflow(record_count, sizeof(trace_record_t),
+                             &file_size) ||
+      __builtin_add_overflow(file_size, sizeof(trace_header_t), &file_size)) {
+    errno = EINVAL;
+    return -1;
+  }
+  int trace_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace_fd < 0) {
+    return -1;
+  }
+  void *mapping = MAP_FAILED;
+  if (ftruncate(trace_fd, file_size) == 0) {
+    mapping = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   trace_fd, 0);
+  }
+  int saved_errno = errno;
+  close(trace_fd);
+  if (mapping == MAP_FAILED) {
+    errno = saved_errno;
+    return -1;
+  }
+
+  trace_header_t *header = mapping;
+  header->magic = TRACE_MAGIC;
+  header->version = TRACE_VERSION;
+  header->record_size = sizeof(trace_record_t);
+  header->capacity = record_count;
+  header->next_record = 0;
+  trace_file = header;
+  __atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void trace_stop() {
+  if (!tracing) {
+    return;
+  }
+  __atomic_store_n(&tracing, 0, __ATOMIC_SEQ_CST);
+  // Writers that registered before tracing was cleared are let finish, later
+  // ones see it cleared and back off
+  while (__atomic_load_n(&trace_writer_count, __ATOMIC_SEQ_CST)) {
+    sched_yield();
+  }
+  size_t file_size =
+      sizeof(trace_header_t) + trace_file->capacity * sizeof(trace_record_t);
+  msync(trace_file, file_size, MS_ASYNC);
+  munmap(trace_file, file_size);
+  trace_file = NULL;
+}
+
+trace_record_t *get_trace_records(trace_header_t *header) {
+  return (trace_record_t *)(header + 1);
+}
+
+void trace_event(int op, void *pointer, void *argument, size_t size) {
+  __atomic_add_fetch(&trace_writer_count, 1, __ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&tracing, __ATOMIC_SEQ_CST)) {
+    __atomic_sub_fetch(&trace_writer_count, 1, __ATOMIC_RELEASE);
+    return;
+  }
+  trace_header_t *header = __atomic_load_n(&trace_file, __ATOMIC_ACQUIRE);
+  if (!trace_thread_id) {
+    trace_thread_id =
+        __atomic_add_fetch(&trace_thread_count, 1, __ATOMIC_RELAXED);
+  }
+  uint64_t index =
+      __atomic_fetch_add(&header->next_record, 1, __ATOMIC_RELAXED);
+  trace_record_t *record =
+      &get_trace_records(header)[index % header->capacity];
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  record->timestamp = (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+  record->pointer = (uintptr_t)pointer;
+  record->argument = (uintptr_t)argument;
+  record->size = size;
+  record->op = op;
+  record->thread = trace_thread_id;
+  __atomic_sub_fetch(&trace_writer_count, 1, __ATOMIC_RELEASE);
+}
+
+/* Heap profiling
+ * Every thread counts down the bytes it allocates, and the allocation that
+ * runs the count out is sampled. Drawing the distances from an exponential
+ * distribution makes the samples a Poisson process over the allocated bytes,
+ * so every byte has the same chance of being sampled whatever the size of
+ * its object. Sampled objects get a mapping of their own, which is how free
+ * tells them apart without a lookup: only mapped chunks are looked up in the
+ * samples. The mapping costs at most a page per sample.
+ */
+
+int profile_start(size_t sample_bytes) {
+  if (sample_bytes == 0 || sample_bytes > PTRDIFF_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  pthread_mutex_lock(&profile_lock);
+  if (!profile_samples) {
+    void *samples = mmap(NULL, PROFILE_MAX_SAMPLES * sizeof(profile_sample_t),
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+    void *buckets = mmap(NULL, PROFILE_BUCKET_COUNT * sizeof(void *),
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+    if (samples == MAP_FAILED || buckets == MAP_FAILED) {
+      if (samples != MAP_FAILED) {
+        munmap(samples, PROFILE_MAX_SAMPLES * sizeof(profile_sample_t));
+      }
+      if (buckets != MAP_FAILED) {
+        munmap(buckets, PROFILE_BUCKET_COUNT * sizeof(void *));
+      }
+      pthread_mutex_unlock(&profile_lock);
+      return -1;
+    }
+    profile_samples = samples;
+    profile_buckets = buckets;
+  }
+  profile_sampling_rate = sample_bytes;
+  pthread_mutex_unlock(&profile_lock);
+  // The first backtrace() loads the unwinder, which allocates
+  void *frame;
+  backtrace(&frame, 1);
+  __atomic_store_n(&profile_sample_bytes, sample_bytes, __ATOMIC_RELEASE);
+  // Other threads notice within PROFILE_RECHECK_BYTES, this one right away
+  profile_bytes_until_sample = 0;
+  return 0;
+}
+
+void profile_stop() {
+  __atomic_store_n(&profile_sample_bytes, 0, __ATOMIC_RELEASE);
+}
+
+// ln(2), so that the allocator needs no libm
+#define PROFILE_LN2 0.6931471805599453
+
+double exponential_variate(uint64_t random_bits) {
+  uint64_t value = (random_bits >> 11) + 1;
+  int exponent = 63 - __builtin_clzll(value);
+  double fraction = (double)value / ((uint64_t)1 << exponent) - 1;
+  // ln(1 + f) = 2 atanh(f / (2 + f)), the series converges fast for f < 1
+  double t = fraction / (2 + fraction);
+  double t_squared = t * t;
+  double log_value =
+      exponent * PROFILE_LN2 +
+      2 * t * (1 + t_squared * (1.0 / 3 + t_squared * (0.2 + t_squared / 7)));
+  return 53 * PROFILE_LN2 - log_value;
+}
+
+/* A thread's first countdown, and the first one after profiling got turned
+ * on, only start counting. The bytes before them weren't counted, so ending
+ * them with a sample would favour the first allocations of a thread.
+ */
+int start_next_sample() {
+  size_t sample_bytes =
+      __atomic_load_n(&profile_sample_bytes, __ATOMIC_ACQUIRE);
+  if (!sample_bytes) {
+    profile_countdown_started = 0;
+    profile_bytes_until_sample = PROFILE_RECHECK_BYTES;
+    return 0;
+  }
+  if (!profile_random_state) {
+    profile_random_state = ((uintptr_t)&profile_random_state ^
+                            (uint64_t)clock()) * 0x9e3779b97f4a7c15ull |
+                           1;
+  }
+  // xorshift64*
+  profile_random_state ^= profile_random_state >> 12;
+  profile_random_state ^= profile_random_state << 25;
+  profile_random_state ^= profile_random_state >> 27;
+  double distance =
+      exponential_variate(profile_random_state * 0x2545f4914f6cdd1dull) *
+      sample_bytes;
+  profile_bytes_until_sample =
+      distance < 1 ? 1 : distance >= PTRDIFF_MAX ? PTRDIFF_MAX : distance;
+  int is_sample = profile_countdown_started;
+  profile_countdown_started = 1;
+  return is_sample;
+}
+
+/* The countdown is never negative between calls, since running it out always
+ * starts the next one. Sizes are clamped to PTRDIFF_MAX, which such requests
+ * fail anyway, so subtracting them can't overflow.
+ */
+int count_until_sample(size_t size) {
+  profile_bytes_until_sample -=
+      (ptrdiff_t)(size > PTRDIFF_MAX ? PTRDIFF_MAX : size);
+  return profile_bytes_until_sample < 0;
+}
+
+// The backtrace is taken before any lock, it may allocate
+void *allocate_sample(size_t size) {
+  if (!start_next_sample() || size > PTRDIFF_MAX) {
+    return NULL;
+  }
+  void *frames[PROFILE_MAX_FRAMES];
+  int frame_count = backtrace(frames, PROFILE_MAX_FRAMES);
+  void *payload_ptr = allocate_with_mmap(calculate_aligned_memory(size));
+  if (payload_ptr) {
+    record_sample(payload_ptr, size, frames, frame_count);
+  }
+  return payload_ptr;
+}
+
+void *reallocate_sampled(void *payload_ptr, size_t size) {
+  void *new_payload_ptr = allocate_sample(size);
+  if (new_payload_ptr && payload_ptr) {
+    size_t usable_size = get_usable_size(payload_ptr);
+    memcpy(new_payload_ptr, payload_ptr,
+           size < usable_size ? size : usable_size);
+    free_memory_untraced(payload_ptr);
+  }
+  return new_payload_ptr;
+}
+
+profile_sample_t **get_sample_bucket(void *payload_ptr) {
+  // Every sample has a mapping of its own, the page number tells them apart
+  uintptr_t page = (uintptr_t)payload_ptr >> PAGEMAP_PAGE_SHIFT;
+  return &profile_buckets[(page * 0x9e3779b97f4a7c15ull) >> 50];
+}
+
+// Returns 0 when there's no room left for the sample
+int record_sample(void *payload_ptr, size_t size, void **frames,
+                  int frame_count) {
+  pthread_mutex_lock(&profile_lock);
+  profile_sample_t *sample = free_profile_samples;
+  if (sample) {
+    free_profile_samples = sample->next;
+  } else if (profile_samples_used < PROFILE_MAX_SAMPLES) {
+    sample = &profile_samples[profile_samples_used++];
+  } else {
+    pthread_mutex_unlock(&profile_lock);
+    return 0;
+  }
+  sample->pointer = payload_ptr;
+  sample->size = size;
+  sample->frame_count = frame_count;
+  memcpy(sample->frames, frames, frame_count * sizeof(void *));
+  profile_sample_t **bucket = get_sample_bucket(payload_ptr);
+  sample->next = *bucket;
+  *bucket = sample;
+  __atomic_store_n(&profile_sample_count, profile_sample_count + 1,
+                   __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&profile_lock);
+  return 1;
+}
+
+void drop_sample(void *payload_ptr) {
+  pthread_mutex_lock(&profile_lock);
+  for (profile_sample_t **link = get_sample_bucket(payload_ptr); *link;
+       link = &(*link)->next) {
+    profile_sample_t *sample = *link;
+    if (sample->pointer == payload_ptr) {
+      *link = sample->next;
+      sample->next = free_profile_samples;
+      free_profile_samples = sample;
+      __atomic_store_n(&profile_sample_count, profile_sample_count - 1,
+                       __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&profile_lock);
+}
+
+profile_sample_t *take_sample(void *payload_ptr) {
+  profile_sample_t *sample = NULL;
+  pthread_mutex_lock(&profile_lock);
+  for (profile_sample_t **link = get_sample_bucket(payload_ptr); *link;
+       link = &(*link)->next) {
+    if ((*link)->pointer == payload_ptr) {
+      sample = *link;
+      *link = sample->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&profile_lock);
+  return sample;
+}
+
+void put_sample(profile_sample_t *sample, void *payload_ptr, size_t size) {
+  pthread_mutex_lock(&profile_lock);
+  sample->pointer = payload_ptr;
+  sample->size = size;
+  profile_sample_t **bucket = get_sample_bucket(payload_ptr);
+  sample->next = *bucket;
+  *bucket = sample;
+  pthread_mutex_unlock(&profile_lock);
+}
+
+size_t get_sample_count() {
+  return __atomic_load_n(&profile_sample_count, __ATOMIC_RELAXED);
+}
+
+// One line per sample, written at once
+int write_sample(int fd, profile_sample_t *sample) {
+  char line[64 + PROFILE_MAX_FRAMES * 20];
+  size_t length = snprintf(line, sizeof(line), "1: %zu [1: %zu] @",
+                           sample->size, sample->size);
+  for (int frame = 0; frame < sample->frame_count; ++frame) {
+    length += snprintf(line + length, sizeof(line) - length, " %p",
+                       sample->frames[frame]);
+  }
+  line[length++] = '\n';
+  return write_all(fd, line, length);
+}
+
+int write_mapped_libraries(int fd) {
+  if (write_formatted(fd, "\nMAPPED_LIBRARIES:\n") < 0) {
+    return -1;
+  }
+  int maps_fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (maps_fd < 0) {
+    return -1;
+  }
+  char buffer[4096];
+  ssize_t read_size;
+  while ((read_size = read(maps_fd, buffer, sizeof(buffer))) > 0) {
+    if (write_all(fd, buffer, read_size) < 0) {
+      read_size = -1;
+      break;
+    }
+  }
+  close(maps_fd);
+  return read_size < 0 ? -1 : 0;
+}
+
+/* The header and every line give objects: bytes [objects: bytes], the
+ * second pair standing for all allocations so far in other profilers. Only
+ * the live set is kept here, so both pairs are the same. pprof scales the
+ * samples back up by the sampling rate in the header.
+ */
+int profile_write(int fd) {
+  pthread_mutex_lock(&profile_lock);
+  size_t bucket_count = profile_buckets ? PROFILE_BUCKET_COUNT : 0;
+  size_t live_bytes = 0;
+  for (size_t i = 0; i < bucket_count; ++i) {
+    for (profile_sample_t *sample = profile_buckets[i]; sample;
+         sample = sample->next) {
+      live_bytes += sample->size;
+    }
+  }
+  int result = write_formatted(
+      fd, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+      profile_sample_count, live_bytes, profile_sample_count, live_bytes,
+      profile_sampling_rate);
+  for (size_t i = 0; result >= 0 && i < bucket_count; ++i) {
+    for (profile_sample_t *sample = profile_buckets[i]; result >= 0 && sample;
+         sample = sample->next) {
+      result = write_sample(fd, sample);
+    }
+  }
+  pthread_mutex_unlock(&profile_lock);
+  if (result < 0) {
+    return -1;
+  }
+  return write_mapped_libraries(fd);
+}
+
+void *allocate(size_t size) {
+  void *payload_ptr = NULL;
+  if (count_until_sample(size)) {
+    payload_ptr = allocate_sample(size);
+  }
+  if (!payload_ptr) {
+    payload_ptr = allocate_untraced(size);
+  }
+  if (tracing) {
+    trace_event(TRACE_ALLOCATE, payload_ptr, NULL, size);
+  }
+  return payload_ptr;
+}
+
+// Recorded before the memory can be handed out again
+void free_memory(void *payload_ptr) {
+  if (tracing && payload_ptr) {
+    trace_event(TRACE_FREE, payload_ptr, NULL, 0);
+  }
+  free_memory_untraced(payload_ptr);
+}
+
+// An overflowing size fails before it gets counted or traced
+void *allocate_zeroed(size_t count, size_t size) {
+  size_t total_size;
+  if (__builtin_mul_overflow(count, size, &total_size)) {
+    return allocate_zeroed_untraced(count, size);
+  }
+  void *payload_ptr = NULL;
+  if (count_until_sample(total_size)) {
+    payload_ptr = allocate_sample(total_size);
+  }
+  if (!payload_ptr) {
+    payload_ptr = allocate_zeroed_untraced(count, size);
+  }
+  if (tracing) {
+    trace_event(TRACE_ALLOCATE_ZEROED, payload_ptr, NULL, total_size);
+  }
+  return payload_ptr;
+}
+
+// Counts the whole new size, resizing in place or not
+void *reallocate(void *payload_ptr, size_t size) {
+  void *new_payload_ptr = NULL;
+  if (count_until_sample(size) && size) {
+    new_payload_ptr = reallocate_sampled(payload_ptr, size);
+  }
+  if (!new_payload_ptr) {
+    new_payload_ptr = reallocate_untraced(payload_ptr, size);
+  }
+  if (tracing) {
+    trace_event(TRACE_REALLOCATE, new_payload_ptr, payload_ptr, size);
+  }
+  return new_payload_ptr;
+}
+
+void *allocate_aligned(size_t alignment, size_t size) {
+  void *payload_ptr = allocate_aligned_untraced(alignment, size);
+  if (tracing) {
+    trace_event(TRACE_ALLOCATE_ALIGNED, payload_ptr, (void *)alignment, size);
+  }
+  return payload_ptr;
+}
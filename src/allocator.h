@@ -1,63 +1,496 @@
 #ifndef ALLOCATOR_H
 #define ALLOCATOR_H
 
-#include <math.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include "size_classes.h"
 
 // TODO: turn it into function considering structs alignment
 #define MIN_CHUNK_SIZE sizeof(mchunk_t)
 
 #define CHUNK_HDR_SIZE 2 * sizeof(size_t)
 #define MMAP_THRESHOLD 131072u
+#define MMAP_THRESHOLD_MAX (4 * 1024 * 1024 * sizeof(long))
 #define MEM_ALIGNMENT 16u
 #define HEAP_PAGE 32768u
+#define DEFAULT_TRIM_THRESHOLD 131072u
+#define DEFAULT_TOP_PAD HEAP_PAGE
+#define DEFAULT_RELEASE_THRESHOLD 524288u
 
 // Flags
 #define PREV_INUSE 0b1
 #define IS_MMAP 0b10
 #define IS_INUSE 0b100
-#define ALL_FLAGS 0b111
+#define NON_MAIN_ARENA 0b1000
+#define ALL_FLAGS 0b1111
 
 #define SBRK_ERR (void *)-1
 
-#define BIN_COUNT 123
-#define SMALL_BIN_MAX 1008
-#define LARGE_BIN_64_BYTE_SPACING_MAX 3056
-#define LARGE_BIN_512_BYTE_SPACING_MAX 11248
-#define LARGE_BIN_4096_BYTE_SPACING_MAX 44016
-#define LARGE_BIN_32768_BYTE_SPACING_MAX 142320
+// Bin layout and slab classes are generated, see tools/gen_size_classes.py
+#define UNSORTED_BIN 1
+#define BINMAP_WORD_BITS (8 * sizeof(unsigned long))
+#define BINMAP_WORDS ((BIN_COUNT + BINMAP_WORD_BITS - 1) / BINMAP_WORD_BITS)
+
+// Thread-local cache
+#define TCACHE_MAX_SIZE SMALL_BIN_MAX
+#define TCACHE_BIN_COUNT (TCACHE_MAX_SIZE / MEM_ALIGNMENT + 1)
+#define TCACHE_DEFAULT_COUNT 16
+#define TCACHE_UNREGISTERED 0
+#define TCACHE_ACTIVE 1
+#define TCACHE_SHUT_DOWN 2
+
+// Per-CPU cache, slots per chunk size and CPU
+#define PERCPU_CACHE_MAX_SIZE 512u
+#define PERCPU_CACHE_BIN_COUNT (PERCPU_CACHE_MAX_SIZE / MEM_ALIGNMENT + 1)
+#define PERCPU_CACHE_SLOTS 32u
+
+// Allocation tracing
+#define TRACE_MAGIC 0x3145434152545048ull
+#define TRACE_VERSION 1
+#define TRACE_DEFAULT_RECORDS (1u << 20)
+#define TRACE_SIZE_BITS 40
+#define TRACE_ALLOCATE 1
+#define TRACE_FREE 2
+#define TRACE_ALLOCATE_ZEROED 3
+#define TRACE_REALLOCATE 4
+#define TRACE_ALLOCATE_ALIGNED 5
+
+// Heap profiling
+#define PROFILE_DEFAULT_SAMPLE_BYTES (512u * 1024)
+#define PROFILE_MAX_FRAMES 32
+#define PROFILE_MAX_SAMPLES (1u << 16)
+#define PROFILE_BUCKET_COUNT (1u << 14)
+// How often threads look whether profiling got turned on while it's off
+#define PROFILE_RECHECK_BYTES (16u * 1024 * 1024)
+
+// Fastbins, for chunks of requests up to 128 bytes
+#define FASTBIN_MAX_SIZE 144
+#define FASTBIN_COUNT (FASTBIN_MAX_SIZE / MEM_ALIGNMENT - 1)
+#define FASTBIN_CONSOLIDATION_THRESHOLD 65536
+// Fastbin heads pack a chunk pointer, shifted by the alignment into the 44
+// bits a 48 bit address needs, under a 20 bit tag that wraps around
+#define FASTBIN_POINTER_SHIFT 4
+#define FASTBIN_TAG_SHIFT 44
+#define FASTBIN_TAG_UNIT ((uintptr_t)1 << FASTBIN_TAG_SHIFT)
+#define FASTBIN_POINTER_MASK (FASTBIN_TAG_UNIT - 1)
+
+// Slab runs
+#define SLAB_RUN_SIZE 4096u
+#define SLAB_MAP_WORDS (SLAB_RUN_SIZE / MEM_ALIGNMENT / BINMAP_WORD_BITS)
+#define SLAB_BATCH_SIZE (64 * SLAB_RUN_SIZE)
+#define REMOTE_FREES_QUEUED ((uintptr_t)1)
+
+// Page map, for 4 KiB pages of 48 bit addresses
+#define PAGEMAP_PAGE_SHIFT 12
+#define PAGEMAP_LEVEL_BITS 12
+#define PAGEMAP_NODE_SIZE (1ul << PAGEMAP_LEVEL_BITS)
+#define PAGE_HEAP 1
+#define PAGE_SLAB 2
+#define PAGE_MMAP 3
+#define PAGE_KIND_MASK 3
+
+// Arenas
+#define ARENA_HEAP_SIZE (2 * MMAP_THRESHOLD_MAX)
+#define ARENAS_PER_CPU 8
+
+// Heap analysis, free chunk sizes are counted per power of two
+#define SIZE_HISTOGRAM_BUCKETS (8 * sizeof(size_t))
 
 // Our default struct containing all the necessary information about our memory
 // chunks
 typedef struct mchunk_t {
   size_t prev_size;
-  size_t size_with_flags; // the last 2 bits here are going to be used as flags,
+  size_t size_with_flags; // the last 4 bits here are going to be used as flags,
                           // because of the 16 bit alignment
   struct mchunk_t *fd_chunk;
   struct mchunk_t *bk_chunk;
 } mchunk_t;
 
-// This chunk is always placed on top of the accessible memory and new chunks
-// are split off of it. During the allocation it may be enlarged if necessary.
-extern mchunk_t *top;
-
-extern mchunk_t *bins[BIN_COUNT];
+// Cached chunks are threaded through their payloads
+typedef struct tcache_entry_t {
+  struct tcache_entry_t *next;
+} tcache_entry_t;
+
+typedef struct tcache_t {
+  tcache_entry_t *entries[TCACHE_BIN_COUNT];
+  unsigned short counts[TCACHE_BIN_COUNT];
+} tcache_t;
+
+// Stacks of cached payloads, one per chunk size. Only threads running on the
+// CPU touch them, each push or pop committed by a single store to the count.
+typedef struct percpu_cache_t {
+  unsigned int counts[PERCPU_CACHE_BIN_COUNT];
+  void *slots[PERCPU_CACHE_BIN_COUNT][PERCPU_CACHE_SLOTS];
+} percpu_cache_t;
+
+// One call of the allocation API, the pointers identify the objects
+typedef struct trace_record_t {
+  uint64_t timestamp;
+  // Payload returned, or freed
+  uint64_t pointer;
+  // Payload resized by TRACE_REALLOCATE, alignment of TRACE_ALLOCATE_ALIGNED
+  uint64_t argument;
+  uint64_t size : TRACE_SIZE_BITS;
+  uint64_t op : 8;
+  uint64_t thread : 16;
+} trace_record_t;
+
+// Side metadata of a sampled allocation, linked into a hash bucket by its
+// payload while live and into the free list otherwise
+typedef struct profile_sample_t {
+  void *pointer;
+  size_t size;
+  struct profile_sample_t *next;
+  int frame_count;
+  void *frames[PROFILE_MAX_FRAMES];
+} profile_sample_t;
+
+// Start of the trace file, the ring of records follows it
+typedef struct trace_header_t {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t capacity;
+  // Records ever written, the ring holds the last capacity of them
+  uint64_t next_record;
+} trace_header_t;
+
+// Header at the start of every slab run, followed by its objects
+typedef struct slab_run_t {
+  // Heap of the thread owning the run, nobody else touches its free_map
+  struct thread_heap_t *heap;
+  // Neighbours among the heap's runs of this class with free objects, or
+  // among its full runs
+  struct slab_run_t *next;
+  struct slab_run_t *prev;
+  // Objects freed by other threads, threaded through their payloads. The
+  // REMOTE_FREES_QUEUED bit is set while the run is on its heap's remote list.
+  uintptr_t remote_frees;
+  struct slab_run_t *remote_next;
+  unsigned short object_size;
+  unsigned short capacity;
+  unsigned short free_count;
+  // One bit per object, set while it's free
+  unsigned long free_map[SLAB_MAP_WORDS];
+} slab_run_t;
+
+// The slab runs of a thread. A heap outlives its thread, the next thread to
+// start adopts it along with every run it still owns.
+typedef struct thread_heap_t {
+  // Runs with free objects, per size class
+  slab_run_t *slab_runs[SLAB_CLASS_COUNT];
+  slab_run_t *full_slab_runs;
+  // Runs other threads freed objects into, linked through remote_next
+  slab_run_t *remote_runs;
+  // Next heap waiting to be adopted
+  struct thread_heap_t *next;
+} thread_heap_t;
+
+// Page map entries are an owner pointer tagged with one of the PAGE_* kinds:
+// the arena of a heap page, the run of a slab page or the mapping of a
+// mapped chunk
+typedef struct pagemap_leaf_t {
+  uintptr_t entries[PAGEMAP_NODE_SIZE];
+} pagemap_leaf_t;
+
+typedef struct pagemap_node_t {
+  pagemap_leaf_t *leaves[PAGEMAP_NODE_SIZE];
+} pagemap_node_t;
+
+// Every heap starts with this header: the mmap'd heaps of non-main arenas as
+// well as each stretch of the program break the main arena grows into. The
+// last chunk of a heap that isn't the top is a zero sized fencepost.
+typedef struct heap_info_t {
+  struct arena_t *arena;
+  struct heap_info_t *prev;
+} heap_info_t;
+
+typedef struct arena_t {
+  pthread_mutex_t lock;
+  // This chunk is always placed on top of the accessible memory and new
+  // chunks are split off of it. During the allocation it may be enlarged if
+  // necessary.
+  mchunk_t *top;
+  mchunk_t *bins[BIN_COUNT];
+  // One bit per bin, set while the bin is non-empty
+  unsigned long binmap[BINMAP_WORDS];
+  // Lock-free stacks, tagged chunk pointers
+  uintptr_t fastbins[FASTBIN_COUNT];
+  size_t fastbin_bytes;
+  size_t fastbin_chunk_count;
+  // Threads in the middle of popping a fastbin, the heap can't shrink under
+  // them
+  unsigned int fastbin_poppers;
+  // Bytes sorted into the large bins since their pages were last released
+  size_t unreleased_bytes;
+  // End of the memory the top was carved from, for the main arena it's the
+  // program break set by our last sbrk() call
+  void *heap_end;
+  // Memory from here up to heap_end hasn't been touched since the kernel
+  // handed it over or since it was last released
+  void *untouched_start;
+  // Most recent heap, the older ones are linked through prev
+  heap_info_t *heap;
+  struct arena_t *next;
+  // Statistics, changed under the lock and read without it. Free chunks
+  // count towards the bin their size belongs to, sorted yet or not.
+  size_t heap_bytes;
+  size_t top_bytes;
+  size_t free_chunk_count;
+  size_t bin_free_bytes[BIN_COUNT];
+  // Chunks split off the heap and not yet freed into the bins, the ones
+  // resting in the fastbins included
+  size_t in_use_chunk_count;
+} arena_t;
+
+// Called by heap_walk() for every chunk of a heap, the top included
+typedef void (*heap_walk_callback_t)(arena_t *arena, mchunk_t *memory_chunk,
+                                     void *context);
+
+// Result of analyze_heap(). Chunks in the fastbins count as free, the ones in
+// the thread-local and per-CPU caches as in use. The top is left out of the
+// free chunks, it can always grow anyway.
+typedef struct heap_analysis_t {
+  size_t heap_count;
+  size_t in_use_chunk_count;
+  size_t in_use_bytes;
+  size_t free_chunk_count;
+  size_t free_bytes;
+  size_t largest_free_chunk;
+  size_t top_bytes;
+  // 1 - largest_free_chunk / free_bytes: 0 when all free memory is in one
+  // chunk, approaching 1 as it splinters
+  double fragmentation;
+  // Free chunks of sizes in [2^i, 2^(i+1)), and their bytes
+  size_t size_histogram[SIZE_HISTOGRAM_BUCKETS];
+  size_t size_histogram_bytes[SIZE_HISTOGRAM_BUCKETS];
+  // Free chunks and bytes by the bin their size belongs to
+  size_t bin_chunk_count[BIN_COUNT];
+  size_t bin_free_bytes[BIN_COUNT];
+} heap_analysis_t;
+
+// Snapshot returned by allocator_stats()
+typedef struct allocator_stats_t {
+  // Heap chunks, mapped chunks and whole slab runs handed out. Chunks waiting
+  // in the thread-local and per-CPU caches count as in use.
+  size_t in_use_bytes;
+  // Free heap chunks in the bins and the fastbins, and their bytes
+  size_t free_chunk_count;
+  size_t free_bytes;
+  size_t bin_free_bytes[BIN_COUNT];
+  size_t fastbin_bytes;
+  size_t top_bytes;
+  // Memory from sbrk(), arena heap mappings, chunk mappings and slab run
+  // batches, and all of it together
+  size_t sbrk_bytes;
+  size_t heap_mapped_bytes;
+  size_t mmap_bytes;
+  size_t slab_mapped_bytes;
+  size_t system_bytes;
+  // Heap and mapped chunks handed out, slab objects aren't chunks of their
+  // own
+  size_t in_use_chunk_count;
+  size_t mmap_chunk_count;
+  // Slab runs handed out to thread heaps
+  size_t slab_bytes;
+  size_t peak_sbrk_bytes;
+  size_t peak_mmap_bytes;
+  size_t peak_system_bytes;
+} allocator_stats_t;
+
+// The arena every process starts with, it grows with sbrk()
+extern arena_t main_arena;
+
+// Requests above this size are served by mmap(). It starts at MMAP_THRESHOLD
+// and rises as mapped chunks get freed, up to MMAP_THRESHOLD_MAX, unless it
+// was set with set_mmap_threshold().
+extern size_t mmap_threshold;
+
+extern int mmap_threshold_is_set;
+
+// Largest chunk size freed onto the fastbins, 0 disables them. It can't be
+// raised above FASTBIN_MAX_SIZE.
+extern size_t fastbin_max_size;
+
+// The top gets trimmed down to top_pad spare bytes as soon as freeing makes
+// it bigger than trim_threshold. It follows the mmap threshold unless it was
+// set with set_trim_threshold().
+extern size_t trim_threshold;
+
+extern int trim_threshold_is_set;
+
+extern size_t top_pad;
+
+// Pages of large free chunks are released once this many bytes of them have
+// been sorted into bins, 0 keeps them resident
+extern size_t release_threshold;
+
+// Largest object served by the slab runs, 0 disables them. It can't be
+// raised above SLAB_MAX_SIZE.
+extern size_t slab_max_size;
+
+// Maximum number of chunks every thread caches per chunk size, 0 disables
+// the cache
+extern size_t tcache_count;
+
+// Maximum number of chunks every CPU caches per chunk size, 0 disables the
+// cache. It can't be raised above PERCPU_CACHE_SLOTS and only takes effect
+// where the kernel and libc support restartable sequences.
+extern size_t percpu_cache_count;
+
+// Set while trace_start() records calls
+extern int tracing;
+
+// Mean bytes allocated between two samples of the heap profiler, 0 while it's
+// off
+extern size_t profile_sample_bytes;
+
+// Process wide counters, the per-arena ones are left at 0
+extern allocator_stats_t global_stats;
+
+// Object size of every slab class, and the class of every object size in
+// steps of MEM_ALIGNMENT, both from size_classes.h
+extern const unsigned short slab_class_sizes[SLAB_CLASS_COUNT];
+
+extern const unsigned char slab_class_lookup[SLAB_MAX_SIZE / MEM_ALIGNMENT];
 
 int is_prev_mchunk_in_use(mchunk_t *memory_chunk);
 
 int is_chunk_mmaped(mchunk_t *memory_chunk);
 
+int is_in_use(mchunk_t *memory_chunk);
+
+int is_in_non_main_arena(mchunk_t *memory_chunk);
+
 void set_chunks_flag(mchunk_t *memory_chunk, unsigned long flag);
 
 void unset_chunks_flag(mchunk_t *memory_chunk, unsigned long flag);
 
 size_t get_size(mchunk_t *memory_chunk);
 
-void *create_top();
+void *create_pagemap_node();
+
+void *install_pagemap_node(void **slot);
+
+uintptr_t *get_pagemap_entry(uintptr_t page, int create);
+
+// Returns the tagged owner of the page holding the address, 0 if it isn't
+// ours
+uintptr_t lookup_page(void *address);
+
+int map_pages(void *memory, size_t memory_size, uintptr_t owner);
+
+int get_page_kind(uintptr_t page_owner);
+
+void *get_page_owner(uintptr_t page_owner);
+
+size_t get_arena_flag(arena_t *arena);
+
+heap_info_t *heap_for_chunk(mchunk_t *memory_chunk);
+
+// Returns the arena owning a heap chunk
+arena_t *chunk_arena(mchunk_t *memory_chunk);
+
+heap_info_t *create_heap(arena_t *arena);
+
+void delete_heap(heap_info_t *heap);
+
+void *get_heap_start(heap_info_t *heap);
+
+size_t get_heap_capacity(heap_info_t *heap);
+
+arena_t *create_arena();
+
+size_t get_arena_limit();
+
+arena_t *add_arena();
+
+arena_t *get_next_arena(arena_t *arena);
+
+arena_t *assign_arena();
+
+arena_t *get_thread_arena();
+
+arena_t *lock_thread_arena();
+
+// Handlers to pass to pthread_atfork(), they keep the heap usable in the
+// child of a multithreaded process
+void prepare_fork();
+
+void release_fork_locks_in_parent();
+
+void release_fork_locks_in_child();
+
+void raise_peak(size_t *peak, size_t value);
+
+// Counts memory taken from or given back to the kernel
+void count_system_memory(size_t *counter, ptrdiff_t delta, size_t *peak);
+
+void update_top_bytes(arena_t *arena);
+
+// Free bytes are counted in the bin the chunk's size belongs to, even while
+// it waits in the unsorted bin
+void count_free_chunk(arena_t *arena, int bin_number, size_t chunk_size,
+                      int chunk_delta);
+
+// Called under the lock as heap chunks are handed out or go back to the bins
+void count_in_use_chunk(arena_t *arena, int chunk_delta);
+
+// Snapshot of the counters, taken without any lock. Counters keep changing
+// while it is read, so under concurrent use the values are only roughly
+// consistent with each other.
+void allocator_stats(allocator_stats_t *stats);
+
+// Starts a heap in memory from sbrk(), which doesn't continue the last one
+void start_main_heap(arena_t *arena, void *memory, size_t memory_size);
+
+void *create_top(arena_t *arena);
+
+void start_top(arena_t *arena, void *memory, size_t memory_size);
+
+void retire_top(arena_t *arena);
 
-void *extend_top(size_t memory_size);
+void *extend_top(arena_t *arena, size_t memory_size);
 
-int is_top_too_small(size_t memory_size);
+int trim_top(arena_t *arena, size_t pad);
+
+void walk_arena(arena_t *arena, heap_walk_callback_t callback, void *context);
+
+// Calls back for every chunk of every arena, heap by heap from the most
+// recent one, holding the lock of the arena being walked. The callback must
+// not allocate or free from the heap.
+void heap_walk(heap_walk_callback_t callback, void *context);
+
+void analyze_chunk(arena_t *arena, mchunk_t *memory_chunk, void *context);
+
+void analyze_free_chunk(heap_analysis_t *analysis, size_t chunk_size);
+
+// Moves the chunks in the (locked) arena's fastbins over to the free ones,
+// leaving the fastbins as they were
+void analyze_fastbins(arena_t *arena, heap_analysis_t *analysis);
+
+// Walks the heap, the fastbins are counted as free but left in place
+void analyze_heap(heap_analysis_t *analysis);
+
+// Writes the whole buffer, returns 0 or -1 with errno set
+int write_all(int fd, const char *buffer, size_t size);
+
+// dprintf() without its buffer, which older glibc allocates. Output past 255
+// bytes is cut off.
+int write_formatted(int fd, const char *format, ...);
+
+// Writes the analysis out without allocating
+void print_heap_analysis(int fd, const heap_analysis_t *analysis);
+
+// Trims the top of every arena down to pad spare bytes, returns whether any
+// memory went back to the kernel
+int allocator_trim(size_t pad);
+
+int is_top_too_small(arena_t *arena, size_t memory_size);
+
+size_t get_page_size();
 
 size_t calculate_needed_memory(size_t chunks_payload);
 
@@ -65,11 +498,89 @@ size_t align_up_to_multiple_of_16(size_t number_to_align);
 
 size_t calculate_aligned_memory(size_t requested_size);
 
-void *create_chunk_and_return_payloads_pointer(size_t memory_size);
+void *create_chunk_and_return_payloads_pointer(arena_t *arena,
+                                               size_t memory_size);
+
+int is_fastbin_size(size_t memory_size);
+
+// Whether a chunk goes onto a fastbin when freed: its size fits, and so does
+// its address in a packed head
+int is_fastbin_chunk(mchunk_t *memory_chunk);
+
+int fastbin_index(size_t memory_size);
+
+void add_chunk_to_fastbin(arena_t *arena, mchunk_t *memory_chunk);
+
+// Packs a chunk into a fastbin head, with the tag of the previous head
+// bumped
+uintptr_t make_fastbin_head(mchunk_t *memory_chunk, uintptr_t previous_head);
+
+mchunk_t *get_fastbin_chunk(uintptr_t fastbin_head);
+
+mchunk_t *get_fastbin_head(arena_t *arena, int fastbin);
+
+mchunk_t *take_chunk_from_fastbin(arena_t *arena, size_t memory_size);
+
+// Frees every fastbin chunk for real, coalescing it with its neighbours
+void consolidate_fastbins(arena_t *arena);
+
+int is_slab_size(size_t memory_size);
+
+int slab_class_index(size_t memory_size);
+
+// Rounds a slab sized chunk size up to the one of its class
+size_t round_up_to_slab_class(size_t memory_size);
+
+int is_slab_object(void *payload_ptr);
+
+slab_run_t *get_slab_run(void *payload_ptr);
+
+char *get_slab_objects_start(slab_run_t *run);
+
+void create_thread_heap_key();
+
+// Returns the calling thread's heap, adopting or mapping one on first use.
+// It's NULL once the thread is shutting down.
+thread_heap_t *get_thread_heap();
+
+void release_thread_heap(void *thread_heap);
+
+slab_run_t *create_slab_run(thread_heap_t *heap, size_t object_size);
+
+void release_slab_run(slab_run_t *run);
+
+void add_slab_run(slab_run_t **run_list, slab_run_t *run);
+
+void remove_slab_run(slab_run_t **run_list, slab_run_t *run);
+
+void *allocate_from_slab(size_t memory_size);
+
+// Frees objects of the calling thread's runs in place and queues the rest on
+// their owners' runs, neither takes a lock
+void free_slab_object(void *payload_ptr);
+
+void free_local_slab_object(thread_heap_t *heap, slab_run_t *run,
+                            void *payload_ptr);
+
+void free_remote_slab_object(slab_run_t *run, void *payload_ptr);
+
+// Takes back the objects other threads freed into the heap's runs
+void collect_remote_frees(thread_heap_t *heap);
+
+void free_arena_memory(arena_t *arena, mchunk_t *memory_chunk);
+
+mchunk_t *find_free_chunk(arena_t *arena, size_t memory_size);
 
 void *allocate_with_mmap(size_t memory_size);
 
-void *allocate_with_sbrk(size_t memory_size);
+// Fix a threshold, so that freeing mapped chunks no longer adjusts it
+void set_mmap_threshold(size_t threshold);
+
+void set_trim_threshold(size_t threshold);
+
+void free_mmap_memory(mchunk_t *memory_chunk);
+
+void *allocate_with_sbrk(arena_t *arena, size_t memory_size);
 
 mchunk_t *payload_into_mchunk(void *payload_ptr);
 
@@ -77,28 +588,200 @@ void *mchunk_into_payload(mchunk_t *memory_chunk);
 
 mchunk_t *get_next_chunk(mchunk_t *memory_chunk);
 
-void free_memory(void *payload_ptr);
+arena_t *get_payload_arena(void *payload_ptr);
+
+void free_memory_untraced(void *payload_ptr);
 
 mchunk_t *get_next_chunk(mchunk_t *memory_chunk);
 
 mchunk_t *get_previous_chunk(mchunk_t *memory_chunk);
 
-void remove_from_bin(mchunk_t *memory_chunk);
+void remove_from_bin(arena_t *arena, mchunk_t *memory_chunk);
 
 mchunk_t *coalesce_two_chunks(mchunk_t *first_chunk, mchunk_t *second_chunk);
 
-mchunk_t *coalesce_neighbouring_chunks(mchunk_t *memory_chunk);
+mchunk_t *coalesce_neighbouring_chunks(arena_t *arena,
+                                       mchunk_t *memory_chunk);
 
-void merge_chunk_with_top(mchunk_t *memory_chunk);
+void merge_chunk_with_top(arena_t *arena, mchunk_t *memory_chunk);
 
 int find_appropriate_bin(size_t memory_size);
 
-void add_chunk_to_bin(mchunk_t *memory_chunk);
+void add_chunk_to_bin(arena_t *arena, mchunk_t *memory_chunk);
+
+size_t *get_release_marker(mchunk_t *memory_chunk);
+
+int is_chunk_released(mchunk_t *memory_chunk);
+
+void release_chunk_pages(mchunk_t *memory_chunk);
+
+// Releases the pages of every large free chunk of the arena
+void release_free_chunks(arena_t *arena);
+
+void add_chunk_to_unsorted_bin(arena_t *arena, mchunk_t *memory_chunk);
+
+mchunk_t *sort_unsorted_bin(arena_t *arena, size_t memory_size);
+
+void mark_bin(arena_t *arena, int bin_number);
+
+void unmark_bin(arena_t *arena, int bin_number);
+
+int is_bin_marked(arena_t *arena, int bin_number);
+
+int find_next_marked_bin(arena_t *arena, int bin_number);
+
+mchunk_t *find_and_remove_chunk_from_bin(arena_t *arena, size_t memory_size);
+
+void split_chunk(arena_t *arena, mchunk_t *memory_chunk, size_t memory_size);
+
+void free_sbrk_memory(arena_t *arena, mchunk_t *memory_chunk);
+
+int tcache_bin_index(size_t memory_size);
+
+void tcache_thread_shutdown(void *thread_tcache);
+
+void create_tcache_key();
+
+void register_tcache();
+
+void *tcache_get(size_t memory_size);
+
+int tcache_put(void *payload_ptr, size_t chunk_size);
+
+void tcache_flush_bin(int tcache_bin, unsigned int entries_to_flush);
+
+// Returns all chunks cached by the calling thread to the heap
+void tcache_flush();
+
+void create_percpu_caches();
+
+// Returns 1 if restartable sequences are registered for the thread and the
+// per-CPU caches could be mapped
+int percpu_cache_available();
+
+// Current CPU as the kernel last stored it, -1 without restartable sequences
+int get_current_cpu();
+
+// Both return -1 when the thread was preempted or migrated and nothing
+// happened, 0 when the stack was empty or full and 1 on success
+int percpu_cache_pop_slot(unsigned int *count, void **slots, int cpu,
+                          void **payload_ptr);
+
+int percpu_cache_push_slot(unsigned int *count, void **slots,
+                           unsigned int limit, int cpu, void *payload_ptr);
 
-mchunk_t *find_and_remove_chunk_from_bin(size_t memory_size);
+void *percpu_cache_get(size_t memory_size);
 
-void free_sbrk_memory(mchunk_t *memory_chunk);
+int percpu_cache_put(void *payload_ptr, size_t chunk_size);
 
+// Returns all chunks cached for the CPU the thread is running on
+void percpu_cache_flush();
+
+void *allocate_untraced(size_t size);
+
+void *allocate_zeroed_untraced(size_t count, size_t size);
+
+// malloc_usable_size()
+size_t get_usable_size(void *payload_ptr);
+
+void free_chunk_tail(arena_t *arena, mchunk_t *memory_chunk,
+                     size_t memory_size);
+
+int grow_chunk_in_place(arena_t *arena, mchunk_t *memory_chunk,
+                        size_t memory_size);
+
+char *move_mapping(char *old_mapping, size_t old_mapping_size,
+                   size_t mapping_size);
+
+mchunk_t *remap_chunk(mchunk_t *memory_chunk, size_t memory_size);
+
+void *reallocate_untraced(void *payload_ptr, size_t size);
+
+void *allocate_aligned_untraced(size_t alignment, size_t size);
+
+// posix_memalign(), returns 0 or an errno value
+int allocate_aligned_checked(void **payload_ptr, size_t alignment,
+                             size_t size);
+
+// Maps the ring file, creating it if needed, and starts recording every call.
+// Returns 0, or -1 with errno set (EINVAL while tracing or when the ring
+// wouldn't fit the address space).
+int trace_start(const char *path, size_t record_count);
+
+// Stops recording and unmaps the ring once the calls in flight have written
+// their records
+void trace_stop();
+
+trace_record_t *get_trace_records(trace_header_t *header);
+
+void trace_event(int op, void *pointer, void *argument, size_t size);
+
+// Starts sampling allocations on average every sample_bytes allocated bytes.
+// Returns 0, or -1 with errno set.
+int profile_start(size_t sample_bytes);
+
+// Stops sampling. Live samples stay until their objects are freed.
+void profile_stop();
+
+// -ln(u) for u uniform in (0, 1] drawn from the bits, without libm
+double exponential_variate(uint64_t random_bits);
+
+// Counts an allocation's size down to the next sample, returns whether it ran
+// the countdown out
+int count_until_sample(size_t size);
+
+// Slow path of the sampling countdown: starts the next one and returns
+// whether the allocation that ran it out is a sample
+int start_next_sample();
+
+// Returns a mapped, zeroed sampled object, or NULL when the allocation isn't
+// sampled after all
+void *allocate_sample(size_t size);
+
+// realloc() whose new size ran the countdown out
+void *reallocate_sampled(void *payload_ptr, size_t size);
+
+int record_sample(void *payload_ptr, size_t size, void **frames,
+                  int frame_count);
+
+profile_sample_t **get_sample_bucket(void *payload_ptr);
+
+// Drops the sample of a mapped chunk being freed, if it is one
+void drop_sample(void *payload_ptr);
+
+// Takes the sample of a mapped chunk out of the table while its mapping gets
+// resized, its old address may be reused by another sample in the meantime
+profile_sample_t *take_sample(void *payload_ptr);
+
+void put_sample(profile_sample_t *sample, void *payload_ptr, size_t size);
+
+// Number of live samples
+size_t get_sample_count();
+
+int write_sample(int fd, profile_sample_t *sample);
+
+// Copies /proc/self/maps, for pprof to symbolize the addresses with
+int write_mapped_libraries(int fd);
+
+// Writes the live samples in the legacy heap profile format pprof reads,
+// followed by the mappings of the process for symbolization. Doesn't
+// allocate. Returns 0, or -1 with errno set.
+int profile_write(int fd);
+
+// The entry points record their calls while tracing is on, and count down to
+// the next sample
 void *allocate(size_t size);
 
+void free_memory(void *payload_ptr);
+
+// calloc(), fails instead of overflowing count * size
+void *allocate_zeroed(size_t count, size_t size);
+
+// realloc(), resizes in place whenever it can
+void *reallocate(void *payload_ptr, size_t size);
+
+// memalign() and aligned_alloc(), alignments that aren't a power of two get
+// rounded up to one
+void *allocate_aligned(size_t alignment, size_t size);
+
 #endif
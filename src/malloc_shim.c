@@ -0,0 +1,137 @@
+/* Drop-in replacement for the libc allocator, built as a shared library and
+ * loaded with LD_PRELOAD. Every entry point forwards to the allocator, none
+ * of them looks up the libc versions with dlsym(), so there is nothing to
+ * recurse into while the process is still starting up: the main arena is
+ * statically initialized and usable before any constructor runs.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "allocator.h"
+
+// The library is built with -fvisibility=hidden, so the allocators own
+// symbols can't be interposed by the program, only these ones are exported
+#define SHIM_EXPORT __attribute__((visibility("default")))
+
+// Every process, children included, records its calls into the file named by
+// HEAP_ALLOCATOR_TRACE followed by its pid, with room for
+// HEAP_ALLOCATOR_TRACE_RECORDS of them
+static void start_tracing(void) {
+  const char *trace_prefix = getenv("HEAP_ALLOCATOR_TRACE");
+  if (!trace_prefix) {
+    return;
+  }
+  char trace_path[PATH_MAX];
+  snprintf(trace_path, sizeof(trace_path), "%s.%d", trace_prefix, getpid());
+  const char *record_count = getenv("HEAP_ALLOCATOR_TRACE_RECORDS");
+  trace_start(trace_path, record_count ? strtoull(record_count, NULL, 10)
+                                       : TRACE_DEFAULT_RECORDS);
+}
+
+// With HEAP_ALLOCATOR_PROFILE set, every process samples its allocations
+// every HEAP_ALLOCATOR_PROFILE_SAMPLE_BYTES on average and writes what is
+// still live at exit into that path followed by its pid
+static void write_profile(void) {
+  const char *profile_prefix = getenv("HEAP_ALLOCATOR_PROFILE");
+  if (!profile_prefix) {
+    return;
+  }
+  char profile_path[PATH_MAX];
+  snprintf(profile_path, sizeof(profile_path), "%s.%d", profile_prefix,
+           getpid());
+  int profile_fd =
+      open(profile_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (profile_fd >= 0) {
+    profile_write(profile_fd);
+    close(profile_fd);
+  }
+}
+
+static void start_profiling(void) {
+  if (!getenv("HEAP_ALLOCATOR_PROFILE")) {
+    return;
+  }
+  const char *sample_bytes = getenv("HEAP_ALLOCATOR_PROFILE_SAMPLE_BYTES");
+  if (profile_start(sample_bytes ? strtoull(sample_bytes, NULL, 10)
+                                 : PROFILE_DEFAULT_SAMPLE_BYTES) == 0) {
+    atexit(write_profile);
+  }
+}
+
+// A forked child would otherwise keep writing into its parent's trace
+static void prepare_child(void) {
+  release_fork_locks_in_child();
+  if (tracing) {
+    trace_stop();
+    start_tracing();
+  }
+}
+
+// pthread_atfork() may allocate, so it's called once the library is loaded
+// rather than from within an allocation
+__attribute__((constructor)) static void register_fork_handlers(void) {
+  pthread_atfork(prepare_fork, release_fork_locks_in_parent, prepare_child);
+  start_tracing();
+  start_profiling();
+}
+
+SHIM_EXPORT void *malloc(size_t size) { return allocate(size); }
+
+SHIM_EXPORT void free(void *ptr) { free_memory(ptr); }
+
+SHIM_EXPORT void cfree(void *ptr) { free_memory(ptr); }
+
+SHIM_EXPORT void *calloc(size_t count, size_t size) {
+  return allocate_zeroed(count, size);
+}
+
+SHIM_EXPORT void *realloc(void *ptr, size_t size) {
+  return reallocate(ptr, size);
+}
+
+SHIM_EXPORT void *reallocarray(void *ptr, size_t count, size_t size) {
+  size_t total_size;
+  if (__builtin_mul_overflow(count, size, &total_size)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return reallocate(ptr, total_size);
+}
+
+SHIM_EXPORT void *memalign(size_t alignment, size_t size) {
+  return allocate_aligned(alignment, size);
+}
+
+SHIM_EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+  return allocate_aligned(alignment, size);
+}
+
+SHIM_EXPORT int posix_memalign(void **ptr, size_t alignment, size_t size) {
+  return allocate_aligned_checked(ptr, alignment, size);
+}
+
+SHIM_EXPORT void *valloc(size_t size) {
+  return allocate_aligned(get_page_size(), size);
+}
+
+SHIM_EXPORT void *pvalloc(size_t size) {
+  size_t page_size = get_page_size();
+  if (size > PTRDIFF_MAX - page_size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return allocate_aligned(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+SHIM_EXPORT size_t malloc_usable_size(void *ptr) {
+  return get_usable_size(ptr);
+}
+
+SHIM_EXPORT int malloc_trim(size_t pad) { return allocator_trim(pad); }
@@ -0,0 +1,43 @@
+// Generated by tools/gen_size_classes.py
+// Do not edit, rerun the generator instead
+#ifndef SIZE_CLASSES_H
+#define SIZE_CLASSES_H
+
+/*
+ * bins[0] = N/A
+ * bins[1] = unsorted bin
+ * bins[2-63] = small bins(ranging from 32 to 1008 bytes)
+ * bins[64-95] = large bins with 64 byte spacing
+ * bins[96-111] = large bins with 512 byte spacing
+ * bins[112-119] = large bins with 4096 byte spacing
+ * bins[120-121] = large bins with 32768 byte spacing
+ * bins[122] = whats left
+ */
+#define BIN_COUNT 123
+#define SMALL_BIN_MAX 1008
+#define LARGE_BIN_64_BYTE_SPACING_MAX 3056
+#define LARGE_BIN_512_BYTE_SPACING_MAX 11248
+#define LARGE_BIN_4096_BYTE_SPACING_MAX 44016
+#define LARGE_BIN_32768_BYTE_SPACING_MAX 142320
+
+// Spacing tiers of the large bins, the last one holds everything above them
+#define LARGE_BIN_TIER_COUNT 5
+#define LARGE_BIN_TIER_START { \
+    1008, 3056, 11248, 44016, 142320}
+#define LARGE_BIN_TIER_FIRST_BIN { \
+    63, 95, 111, 119, 121}
+#define LARGE_BIN_TIER_SHIFT { \
+    6, 9, 12, 15, 63}
+// Pages of free chunks from this size up get released to the kernel
+#define RELEASE_MIN_SIZE 11264u
+
+// Slab object sizes, for requests up to 256 bytes
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASS_COUNT 16
+#define SLAB_CLASS_SIZES { \
+    16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256}
+// Class of every object size, in steps of the alignment
+#define SLAB_CLASS_LOOKUP { \
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15}
+
+#endif
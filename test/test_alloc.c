@@ -1,18 +1,52 @@
+#define _GNU_SOURCE
 #include "../src/allocator.h"
 #include "../unity/unity.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #define SMALL_BIN_ALLOCATION 512ul
 #define SMALL_SBRK_ALLOCATION 4096ul
 #define BIG_SBRK_ALLOCATION 65536ul
+#define MMAP_ALLOCATION 262144ul
+#define TCACHE_ALLOCATION 64ul
+#define TRIM_ALLOCATION (1024ul * 1024)
+#define ARENA_HEAP_ALLOCATION (40ul * 1024 * 1024)
+#define STRESS_THREADS 4
+#define STRESS_ITERATIONS 20000
+#define STRESS_SLOTS 64
 
-void setUp(void) {}
+// The bin tests need freed chunks to reach the heap, so the thread-local
+// cache and the fastbins are only enabled by the tests exercising them. The
+// thresholds go back to their defaults too, freeing a mapping moves them and
+// a failed test skips its own resets.
+void setUp(void) {
+  tcache_count = 0;
+  tcache_flush();
+  percpu_cache_count = 0;
+  fastbin_max_size = 0;
+  slab_max_size = 0;
+  mmap_threshold = MMAP_THRESHOLD;
+  mmap_threshold_is_set = 0;
+  trim_threshold = DEFAULT_TRIM_THRESHOLD;
+  trim_threshold_is_set = 0;
+  release_threshold = DEFAULT_RELEASE_THRESHOLD;
+  pthread_mutex_lock(&main_arena.lock);
+  consolidate_fastbins(&main_arena);
+  pthread_mutex_unlock(&main_arena.lock);
+}
 
 void tearDown(void) {}
 
 static int count_bin_entries(int bin_number) {
   int count = 0;
-  mchunk_t *cur = bins[bin_number];
+  mchunk_t *cur = main_arena.bins[bin_number];
   while (cur) {
     count++;
     cur = cur->fd_chunk;
@@ -23,21 +57,27 @@ static int count_bin_entries(int bin_number) {
 void test_is_memory_released_on_top(void) {
   char *test_alloc = allocate(sizeof(char) * 32);
   free_memory(test_alloc);
-  TEST_ASSERT_EQUAL(top, payload_into_mchunk(test_alloc));
+  TEST_ASSERT_EQUAL(main_arena.top, payload_into_mchunk(test_alloc));
 }
 
 void test_big_sbrk_allocation_freeing(void) {
   char *test_alloc = allocate(sizeof(char) * BIG_SBRK_ALLOCATION);
   char *barrier_alloc = allocate(sizeof(char) * 32);
   free_memory(test_alloc);
-  TEST_ASSERT_EQUAL(bins[120], payload_into_mchunk(test_alloc));
+  sort_unsorted_bin(&main_arena, 0);
+  mchunk_t *memory_chunk = payload_into_mchunk(test_alloc);
+  int bin_number = find_appropriate_bin(get_size(memory_chunk));
+  TEST_ASSERT_EQUAL(main_arena.bins[bin_number], memory_chunk);
   free_memory(barrier_alloc);
 }
 void test_is_memory_released_on_bin(void) {
   char *test_alloc = allocate(sizeof(char) * 32);
   char *barrier_alloc = allocate(sizeof(char) * 32);
   free_memory(test_alloc);
-  TEST_ASSERT_EQUAL(payload_into_mchunk(test_alloc), bins[3]);
+  TEST_ASSERT_EQUAL(payload_into_mchunk(test_alloc),
+                    main_arena.bins[UNSORTED_BIN]);
+  sort_unsorted_bin(&main_arena, 0);
+  TEST_ASSERT_EQUAL(payload_into_mchunk(test_alloc), main_arena.bins[3]);
   free_memory(barrier_alloc);
 }
 void test_coalesce_two_small_chunks(void) {
@@ -46,7 +86,8 @@ void test_coalesce_two_small_chunks(void) {
   char *barrier_alloc = allocate(sizeof(char) * 32);
   free_memory(first_alloc);
   free_memory(second_alloc);
-  TEST_ASSERT_NOT_NULL(bins[6]);
+  sort_unsorted_bin(&main_arena, 0);
+  TEST_ASSERT_NOT_NULL(main_arena.bins[6]);
   free_memory(barrier_alloc);
 }
 
@@ -75,22 +116,1171 @@ void test_coalesce_three_small_chunks(void) {
   free_memory(alloc_1);
   free_memory(alloc_2);
   free_memory(alloc_3);
+  sort_unsorted_bin(&main_arena, 0);
 
   int expected_bin_chunks_count = 1;
   int actual_bin_chunks_count = count_bin_entries(coalesced_bin);
   TEST_ASSERT_EQUAL(expected_bin_chunks_count, actual_bin_chunks_count);
-  TEST_ASSERT_EQUAL(coalesced_size, get_size(bins[coalesced_bin]));
+  TEST_ASSERT_EQUAL(coalesced_size, get_size(main_arena.bins[coalesced_bin]));
   free_memory(barrier);
 }
 
+void test_remove_from_middle_of_bin(void) {
+  char *allocs[3];
+  char *barriers[3];
+  for (int i = 0; i < 3; ++i) {
+    allocs[i] = allocate(sizeof(char) * 32);
+    barriers[i] = allocate(sizeof(char) * 32);
+  }
+  int bin_number =
+      find_appropriate_bin(get_size(payload_into_mchunk(allocs[0])));
+  for (int i = 0; i < 3; ++i) {
+    free_memory(allocs[i]);
+  }
+  sort_unsorted_bin(&main_arena, 0);
+  TEST_ASSERT_EQUAL(3, count_bin_entries(bin_number));
+
+  // Coalescing unlinks the bins head and the entry behind it
+  free_memory(barriers[1]);
+  TEST_ASSERT_EQUAL(1, count_bin_entries(bin_number));
+  TEST_ASSERT_EQUAL_PTR(payload_into_mchunk(allocs[0]),
+                        main_arena.bins[bin_number]);
+  TEST_ASSERT_NULL(main_arena.bins[bin_number]->bk_chunk);
+
+  free_memory(barriers[0]);
+  free_memory(barriers[2]);
+  TEST_ASSERT_FALSE(is_bin_marked(&main_arena, bin_number));
+}
+
+void test_exact_fit_skips_sorting(void) {
+  char *small_alloc = allocate(sizeof(char) * 32);
+  char *first_barrier = allocate(sizeof(char) * 32);
+  char *bigger_alloc = allocate(sizeof(char) * 80);
+  char *second_barrier = allocate(sizeof(char) * 32);
+  mchunk_t *bigger_chunk = payload_into_mchunk(bigger_alloc);
+  free_memory(small_alloc);
+  free_memory(bigger_alloc);
+  TEST_ASSERT_EQUAL_PTR(bigger_chunk, main_arena.bins[UNSORTED_BIN]);
+
+  // The bigger chunk is sorted on the way to the exact fit behind it
+  char *reused_alloc = allocate(sizeof(char) * 32);
+  TEST_ASSERT_EQUAL_PTR(small_alloc, reused_alloc);
+  TEST_ASSERT_NULL(main_arena.bins[UNSORTED_BIN]);
+  int bigger_bin = find_appropriate_bin(get_size(bigger_chunk));
+  TEST_ASSERT_EQUAL_PTR(bigger_chunk, main_arena.bins[bigger_bin]);
+
+  free_memory(reused_alloc);
+  free_memory(first_barrier);
+  free_memory(second_barrier);
+}
+
+// First, second and last size of every bin spacing tier, whatever layout
+// size_classes.h was generated with
+void test_bin_boundaries(void) {
+  const size_t tier_start[] = LARGE_BIN_TIER_START;
+  const int tier_first_bin[] = LARGE_BIN_TIER_FIRST_BIN;
+  const unsigned char tier_shift[] = LARGE_BIN_TIER_SHIFT;
+  TEST_ASSERT_EQUAL(2, find_appropriate_bin(32));
+  TEST_ASSERT_EQUAL(SMALL_BIN_MAX / MEM_ALIGNMENT,
+                    find_appropriate_bin(SMALL_BIN_MAX));
+  for (int tier = 0; tier < LARGE_BIN_TIER_COUNT - 1; ++tier) {
+    size_t spacing = (size_t)1 << tier_shift[tier];
+    int first_bin = tier_first_bin[tier] + 1;
+    // The last bin of the last tier also takes everything above it
+    int last_bin = tier < LARGE_BIN_TIER_COUNT - 2 ? tier_first_bin[tier + 1]
+                                                   : BIN_COUNT - 1;
+    TEST_ASSERT_EQUAL(first_bin,
+                      find_appropriate_bin(tier_start[tier] + MEM_ALIGNMENT));
+    TEST_ASSERT_EQUAL(first_bin,
+                      find_appropriate_bin(tier_start[tier] + spacing));
+    if (first_bin < last_bin) {
+      TEST_ASSERT_EQUAL(first_bin + 1,
+                        find_appropriate_bin(tier_start[tier] + spacing +
+                                             MEM_ALIGNMENT));
+    }
+    TEST_ASSERT_EQUAL(last_bin, find_appropriate_bin(tier_start[tier + 1]));
+  }
+  size_t last_tier_start = tier_start[LARGE_BIN_TIER_COUNT - 1];
+  TEST_ASSERT_EQUAL(BIN_COUNT - 1,
+                    find_appropriate_bin(last_tier_start + MEM_ALIGNMENT));
+  TEST_ASSERT_EQUAL(BIN_COUNT - 1, find_appropriate_bin(PTRDIFF_MAX));
+}
+
 void test_allocate_zero_bytes(void) {
   char *p = allocate(0);
   TEST_ASSERT_NOT_NULL(p);
   free_memory(p);
-  TEST_ASSERT_EQUAL_PTR(top, payload_into_mchunk(p));
+  TEST_ASSERT_EQUAL_PTR(main_arena.top, payload_into_mchunk(p));
+}
+
+void test_binmap_follows_bins(void) {
+  char *test_alloc = allocate(sizeof(char) * 32);
+  char *barrier_alloc = allocate(sizeof(char) * 32);
+  int bin_number =
+      find_appropriate_bin(get_size(payload_into_mchunk(test_alloc)));
+  free_memory(test_alloc);
+  sort_unsorted_bin(&main_arena, 0);
+  TEST_ASSERT_TRUE(is_bin_marked(&main_arena, bin_number));
+  TEST_ASSERT_EQUAL(bin_number, find_next_marked_bin(&main_arena, 0));
+
+  char *second_alloc = allocate(sizeof(char) * 32);
+  TEST_ASSERT_EQUAL_PTR(test_alloc, second_alloc);
+  TEST_ASSERT_FALSE(is_bin_marked(&main_arena, bin_number));
+  TEST_ASSERT_EQUAL(-1, find_next_marked_bin(&main_arena, 0));
+  free_memory(second_alloc);
+  free_memory(barrier_alloc);
+}
+
+void test_allocation_splits_bigger_chunk(void) {
+  char *big_alloc = allocate(sizeof(char) * SMALL_SBRK_ALLOCATION);
+  char *barrier_alloc = allocate(sizeof(char) * 32);
+  size_t big_size = get_size(payload_into_mchunk(big_alloc));
+  free_memory(big_alloc);
+
+  char *small_alloc = allocate(sizeof(char) * 32);
+  TEST_ASSERT_EQUAL_PTR(big_alloc, small_alloc);
+  mchunk_t *small_chunk = payload_into_mchunk(small_alloc);
+  mchunk_t *remainder = get_next_chunk(small_chunk);
+  TEST_ASSERT_EQUAL(big_size - get_size(small_chunk), get_size(remainder));
+  int remainder_bin = find_appropriate_bin(get_size(remainder));
+  TEST_ASSERT_EQUAL_PTR(remainder, main_arena.bins[remainder_bin]);
+  TEST_ASSERT_TRUE(is_prev_mchunk_in_use(remainder));
+
+  free_memory(small_alloc);
+  TEST_ASSERT_EQUAL(big_size, get_size(small_chunk));
+  free_memory(barrier_alloc);
+}
+
+void test_mmap_allocation(void) {
+  char *test_alloc = allocate(sizeof(char) * MMAP_ALLOCATION);
+  TEST_ASSERT_NOT_NULL(test_alloc);
+  mchunk_t *memory_chunk = payload_into_mchunk(test_alloc);
+  TEST_ASSERT_TRUE(is_chunk_mmaped(memory_chunk));
+  TEST_ASSERT_EQUAL(0, get_size(memory_chunk) % get_page_size());
+  TEST_ASSERT_GREATER_OR_EQUAL(MMAP_ALLOCATION + CHUNK_HDR_SIZE,
+                               get_size(memory_chunk));
+  memset(test_alloc, 0xAB, MMAP_ALLOCATION);
+  free_memory(test_alloc);
+}
+
+void test_mmap_threshold_rises_after_free(void) {
+  char *first_alloc = allocate(sizeof(char) * MMAP_ALLOCATION);
+  size_t mapped_size = get_size(payload_into_mchunk(first_alloc));
+  free_memory(first_alloc);
+  TEST_ASSERT_EQUAL(mapped_size, mmap_threshold);
+  TEST_ASSERT_EQUAL(2 * mapped_size, trim_threshold);
+
+  // The same request is now served from the heap
+  char *second_alloc = allocate(sizeof(char) * MMAP_ALLOCATION);
+  TEST_ASSERT_FALSE(is_chunk_mmaped(payload_into_mchunk(second_alloc)));
+  free_memory(second_alloc);
+  mmap_threshold = MMAP_THRESHOLD;
+  trim_threshold = DEFAULT_TRIM_THRESHOLD;
+}
+
+void test_set_thresholds_stay_after_free(void) {
+  set_trim_threshold(DEFAULT_TRIM_THRESHOLD / 2);
+  char *memory = allocate(sizeof(char) * MMAP_ALLOCATION);
+  free_memory(memory);
+  TEST_ASSERT_EQUAL(DEFAULT_TRIM_THRESHOLD / 2, trim_threshold);
+  TEST_ASSERT_TRUE(mmap_threshold > MMAP_THRESHOLD);
+
+  set_mmap_threshold(MMAP_THRESHOLD);
+  memory = allocate(sizeof(char) * MMAP_ALLOCATION);
+  free_memory(memory);
+  TEST_ASSERT_EQUAL(MMAP_THRESHOLD, mmap_threshold);
+  mmap_threshold_is_set = 0;
+  trim_threshold_is_set = 0;
+  trim_threshold = DEFAULT_TRIM_THRESHOLD;
+}
+
+void test_top_is_trimmed_after_free(void) {
+  mmap_threshold = MMAP_THRESHOLD_MAX;
+  char *memory = allocate(sizeof(char) * TRIM_ALLOCATION);
+  void *grown_break = sbrk(0);
+  free_memory(memory);
+
+  TEST_ASSERT_TRUE((char *)sbrk(0) < (char *)grown_break);
+  TEST_ASSERT_EQUAL_PTR(sbrk(0), main_arena.heap_end);
+  TEST_ASSERT_TRUE(get_size(main_arena.top) < trim_threshold);
+  mmap_threshold = MMAP_THRESHOLD;
+}
+
+void test_allocator_trim_releases_top(void) {
+  mmap_threshold = MMAP_THRESHOLD_MAX;
+  trim_threshold = MMAP_THRESHOLD_MAX;
+  char *memory = allocate(sizeof(char) * TRIM_ALLOCATION);
+  free_memory(memory);
+  void *untrimmed_break = sbrk(0);
+  TEST_ASSERT_TRUE(get_size(main_arena.top) > TRIM_ALLOCATION);
+
+  TEST_ASSERT_TRUE(allocator_trim(0));
+  TEST_ASSERT_TRUE((char *)sbrk(0) < (char *)untrimmed_break);
+  size_t trimmed_top_size = get_size(main_arena.top);
+  TEST_ASSERT_TRUE(trimmed_top_size <= get_page_size() + MIN_CHUNK_SIZE);
+  TEST_ASSERT_FALSE(allocator_trim(0));
+  mmap_threshold = MMAP_THRESHOLD;
+  trim_threshold = DEFAULT_TRIM_THRESHOLD;
+}
+
+void test_large_free_chunk_pages_are_released(void) {
+  release_threshold = 1;
+  char *first_alloc = allocate(sizeof(char) * BIG_SBRK_ALLOCATION);
+  char *barrier_alloc = allocate(sizeof(char) * 32);
+  free_memory(first_alloc);
+  sort_unsorted_bin(&main_arena, 0);
+
+  mchunk_t *memory_chunk = payload_into_mchunk(first_alloc);
+  TEST_ASSERT_TRUE(get_size(memory_chunk) >= RELEASE_MIN_SIZE);
+  TEST_ASSERT_TRUE(is_chunk_released(memory_chunk));
+  TEST_ASSERT_EQUAL(0, main_arena.unreleased_bytes);
+
+  // Released pages are still usable once the chunk is handed out again
+  char *second_alloc = allocate(sizeof(char) * BIG_SBRK_ALLOCATION);
+  TEST_ASSERT_EQUAL_PTR(first_alloc, second_alloc);
+  memset(second_alloc, 0xAB, BIG_SBRK_ALLOCATION);
+  TEST_ASSERT_EQUAL_UINT8(0xAB, second_alloc[BIG_SBRK_ALLOCATION - 1]);
+  free_memory(second_alloc);
+  free_memory(barrier_alloc);
+  release_threshold = DEFAULT_RELEASE_THRESHOLD;
+}
+
+void test_release_waits_for_threshold(void) {
+  release_threshold = 4 * BIG_SBRK_ALLOCATION;
+  char *first_alloc = allocate(sizeof(char) * BIG_SBRK_ALLOCATION);
+  char *barrier_alloc = allocate(sizeof(char) * 32);
+  free_memory(first_alloc);
+  sort_unsorted_bin(&main_arena, 0);
+
+  mchunk_t *memory_chunk = payload_into_mchunk(first_alloc);
+  TEST_ASSERT_FALSE(is_chunk_released(memory_chunk));
+  TEST_ASSERT_TRUE(main_arena.unreleased_bytes >= get_size(memory_chunk));
+
+  release_free_chunks(&main_arena);
+  TEST_ASSERT_TRUE(is_chunk_released(memory_chunk));
+  free_memory(barrier_alloc);
+  release_threshold = DEFAULT_RELEASE_THRESHOLD;
+}
+
+void test_allocate_zeroed(void) {
+  char *dirty_alloc = allocate(sizeof(char) * SMALL_BIN_ALLOCATION);
+  char *barrier_alloc = allocate(sizeof(char) * 32);
+  memset(dirty_alloc, 0xFF, SMALL_BIN_ALLOCATION);
+  free_memory(dirty_alloc);
+
+  // The dirty chunk gets reused and still comes back cleared
+  char *zeroed_alloc = allocate_zeroed(SMALL_BIN_ALLOCATION / 8, 8);
+  TEST_ASSERT_EQUAL_PTR(dirty_alloc, zeroed_alloc);
+  for (size_t i = 0; i < SMALL_BIN_ALLOCATION; ++i) {
+    TEST_ASSERT_EQUAL_UINT8(0, zeroed_alloc[i]);
+  }
+  TEST_ASSERT_NULL(allocate_zeroed(SIZE_MAX / 2, 4));
+  free_memory(zeroed_alloc);
+  free_memory(barrier_alloc);
+}
+
+static int is_page_resident(void *address) {
+  size_t page_size = get_page_size();
+  unsigned char residency;
+  void *page = (void *)((uintptr_t)address & ~(page_size - 1));
+  mincore(page, page_size, &residency);
+  return residency & 1;
+}
+
+void test_allocate_zeroed_skips_fresh_memory(void) {
+  mmap_threshold = MMAP_THRESHOLD_MAX;
+  trim_threshold = MMAP_THRESHOLD_MAX;
+  // Sliced off a freshly grown top, most of it was never touched
+  char *heap_alloc = allocate_zeroed(TRIM_ALLOCATION, 1);
+  TEST_ASSERT_FALSE(is_chunk_mmaped(payload_into_mchunk(heap_alloc)));
+  TEST_ASSERT_FALSE(is_page_resident(heap_alloc + TRIM_ALLOCATION / 2));
+  TEST_ASSERT_EQUAL_UINT8(0, heap_alloc[TRIM_ALLOCATION / 2]);
+  free_memory(heap_alloc);
+  mmap_threshold = MMAP_THRESHOLD;
+
+  char *mapped_alloc = allocate_zeroed(MMAP_ALLOCATION, 1);
+  TEST_ASSERT_TRUE(is_chunk_mmaped(payload_into_mchunk(mapped_alloc)));
+  TEST_ASSERT_FALSE(is_page_resident(mapped_alloc + MMAP_ALLOCATION / 2));
+  free_memory(mapped_alloc);
+  mmap_threshold = MMAP_THRESHOLD;
+  trim_threshold = DEFAULT_TRIM_THRESHOLD;
+}
+
+void test_reallocate_grows_into_top(void) {
+  char *memory = allocate(sizeof(char) * SMALL_BIN_ALLOCATION);
+  memset(memory, 0x5A, SMALL_BIN_ALLOCATION);
+  char *grown = reallocate(memory, SMALL_SBRK_ALLOCATION);
+  TEST_ASSERT_EQUAL_PTR(memory, grown);
+  TEST_ASSERT_TRUE(get_usable_size(grown) >= SMALL_SBRK_ALLOCATION);
+  TEST_ASSERT_EQUAL_PTR(get_next_chunk(payload_into_mchunk(grown)),
+                        main_arena.top);
+  TEST_ASSERT_EQUAL_UINT8(0x5A, grown[SMALL_BIN_ALLOCATION - 1]);
+  free_memory(grown);
+}
+
+void test_reallocate_grows_into_free_chunk(void) {
+  char *memory = allocate(sizeof(char) * SMALL_BIN_ALLOCATION);
+  char *next_alloc = allocate(sizeof(char) * SMALL_SBRK_ALLOCATION);
+  char *barrier_alloc = allocate(sizeof(char) * 32);
+  free_memory(next_alloc);
+
+  char *grown = reallocate(memory, 2 * SMALL_BIN_ALLOCATION);
+  TEST_ASSERT_EQUAL_PTR(memory, grown);
+  // The rest of the free chunk went back to the bins
+  mchunk_t *remainder = get_next_chunk(payload_into_mchunk(grown));
+  TEST_ASSERT_FALSE(is_in_use(remainder));
+  TEST_ASSERT_TRUE(is_prev_mchunk_in_use(remainder));
+  free_memory(grown);
+  free_memory(barrier_alloc);
+}
+
+void test_reallocate_moves_data(void) {
+  char *memory = allocate(sizeof(char) * SMALL_BIN_ALLOCATION);
+  char *barrier_alloc = allocate(sizeof(char) * 32);
+  memset(memory, 0x3C, SMALL_BIN_ALLOCATION);
+
+  char *moved = reallocate(memory, SMALL_SBRK_ALLOCATION);
+  TEST_ASSERT_NOT_EQUAL(memory, moved);
+  for (size_t i = 0; i < SMALL_BIN_ALLOCATION; ++i) {
+    TEST_ASSERT_EQUAL_UINT8(0x3C, moved[i]);
+  }
+  TEST_ASSERT_NULL(reallocate(moved, 0));
+  free_memory(barrier_alloc);
+}
+
+void test_reallocate_shrinks_in_place(void) {
+  char *memory = allocate(sizeof(char) * SMALL_SBRK_ALLOCATION);
+  char *barrier_alloc = allocate(sizeof(char) * 32);
+  memset(memory, 0x77, SMALL_BIN_ALLOCATION);
+
+  char *shrunk = reallocate(memory, SMALL_BIN_ALLOCATION);
+  TEST_ASSERT_EQUAL_PTR(memory, shrunk);
+  TEST_ASSERT_EQUAL_UINT8(0x77, shrunk[SMALL_BIN_ALLOCATION - 1]);
+  // The tail is a free chunk now
+  mchunk_t *tail = get_next_chunk(payload_into_mchunk(shrunk));
+  TEST_ASSERT_FALSE(is_in_use(tail));
+  TEST_ASSERT_EQUAL_PTR(tail, main_arena.bins[UNSORTED_BIN]);
+  TEST_ASSERT_FALSE(is_prev_mchunk_in_use(payload_into_mchunk(barrier_alloc)));
+  free_memory(shrunk);
+  free_memory(barrier_alloc);
+}
+
+void test_reallocate_remaps_mmap_chunk(void) {
+  char *memory = allocate(sizeof(char) * MMAP_ALLOCATION);
+  memset(memory, 0x42, MMAP_ALLOCATION);
+
+  char *grown = reallocate(memory, 4 * MMAP_ALLOCATION);
+  mchunk_t *grown_chunk = payload_into_mchunk(grown);
+  TEST_ASSERT_TRUE(is_chunk_mmaped(grown_chunk));
+  TEST_ASSERT_TRUE(get_usable_size(grown) >= 4 * MMAP_ALLOCATION);
+  TEST_ASSERT_EQUAL_UINT8(0x42, grown[MMAP_ALLOCATION - 1]);
+  memset(grown, 0x42, 4 * MMAP_ALLOCATION);
+
+  char *shrunk = reallocate(grown, MMAP_ALLOCATION);
+  TEST_ASSERT_TRUE(get_size(payload_into_mchunk(shrunk)) <
+                   4 * MMAP_ALLOCATION);
+  TEST_ASSERT_EQUAL_UINT8(0x42, shrunk[MMAP_ALLOCATION - 1]);
+  free_memory(shrunk);
+  mmap_threshold = MMAP_THRESHOLD;
+  trim_threshold = DEFAULT_TRIM_THRESHOLD;
+}
+
+void test_allocate_aligned(void) {
+  size_t alignments[] = {64, 4096, 65536};
+  for (size_t i = 0; i < sizeof(alignments) / sizeof(*alignments); ++i) {
+    char *heap_alloc = allocate_aligned(alignments[i], SMALL_BIN_ALLOCATION);
+    char *mapped_alloc = allocate_aligned(alignments[i], MMAP_ALLOCATION);
+    TEST_ASSERT_EQUAL(0, (uintptr_t)heap_alloc % alignments[i]);
+    TEST_ASSERT_EQUAL(0, (uintptr_t)mapped_alloc % alignments[i]);
+    TEST_ASSERT_FALSE(is_chunk_mmaped(payload_into_mchunk(heap_alloc)));
+    TEST_ASSERT_TRUE(is_chunk_mmaped(payload_into_mchunk(mapped_alloc)));
+    TEST_ASSERT_TRUE(get_usable_size(heap_alloc) >= SMALL_BIN_ALLOCATION);
+    memset(heap_alloc, 0xEE, SMALL_BIN_ALLOCATION);
+    memset(mapped_alloc, 0xEE, MMAP_ALLOCATION);
+    free_memory(heap_alloc);
+    free_memory(mapped_alloc);
+  }
+  mmap_threshold = MMAP_THRESHOLD;
+  trim_threshold = DEFAULT_TRIM_THRESHOLD;
+
+  // Odd alignments are rounded up to the next power of two
+  char *odd_alloc = allocate_aligned(100, 32);
+  TEST_ASSERT_EQUAL(0, (uintptr_t)odd_alloc % 128);
+  free_memory(odd_alloc);
+
+  void *checked_alloc = NULL;
+  TEST_ASSERT_EQUAL(EINVAL, allocate_aligned_checked(&checked_alloc, 100, 32));
+  TEST_ASSERT_EQUAL(0, allocate_aligned_checked(&checked_alloc, 256, 32));
+  TEST_ASSERT_EQUAL(0, (uintptr_t)checked_alloc % 256);
+  free_memory(checked_alloc);
+}
+
+void test_tcache_reuses_freed_chunk(void) {
+  tcache_count = TCACHE_DEFAULT_COUNT;
+  char *first_alloc = allocate(sizeof(char) * TCACHE_ALLOCATION);
+  char *barrier_alloc = allocate(sizeof(char) * 32);
+  free_memory(first_alloc);
+
+  // Cached chunks look allocated to the heap
+  mchunk_t *memory_chunk = payload_into_mchunk(first_alloc);
+  TEST_ASSERT_TRUE(is_in_use(memory_chunk));
+  int bin_number = find_appropriate_bin(get_size(memory_chunk));
+  TEST_ASSERT_NULL(main_arena.bins[bin_number]);
+
+  char *second_alloc = allocate(sizeof(char) * TCACHE_ALLOCATION);
+  TEST_ASSERT_EQUAL_PTR(first_alloc, second_alloc);
+  free_memory(second_alloc);
+  free_memory(barrier_alloc);
+}
+
+void test_tcache_flushes_half_when_full(void) {
+  tcache_count = TCACHE_DEFAULT_COUNT;
+  char *allocs[TCACHE_DEFAULT_COUNT + 1];
+  char *barriers[TCACHE_DEFAULT_COUNT + 1];
+  for (int i = 0; i < TCACHE_DEFAULT_COUNT + 1; ++i) {
+    allocs[i] = allocate(sizeof(char) * TCACHE_ALLOCATION);
+    barriers[i] = allocate(sizeof(char) * SMALL_BIN_ALLOCATION);
+  }
+  int bin_number =
+      find_appropriate_bin(get_size(payload_into_mchunk(allocs[0])));
+  for (int i = 0; i < TCACHE_DEFAULT_COUNT + 1; ++i) {
+    free_memory(allocs[i]);
+  }
+  sort_unsorted_bin(&main_arena, 0);
+  TEST_ASSERT_EQUAL(TCACHE_DEFAULT_COUNT / 2, count_bin_entries(bin_number));
+
+  tcache_count = 0;
+  tcache_flush();
+  for (int i = 0; i < TCACHE_DEFAULT_COUNT + 1; ++i) {
+    free_memory(barriers[i]);
+  }
+}
+
+void test_fastbin_defers_coalescing(void) {
+  fastbin_max_size = FASTBIN_MAX_SIZE;
+  char *first_alloc = allocate(sizeof(char) * 32);
+  char *second_alloc = allocate(sizeof(char) * 32);
+  char *barrier_alloc = allocate(sizeof(char) * 32);
+  mchunk_t *first_chunk = payload_into_mchunk(first_alloc);
+  mchunk_t *second_chunk = payload_into_mchunk(second_alloc);
+  size_t chunk_size = get_size(first_chunk);
+  free_memory(first_alloc);
+  free_memory(second_alloc);
+
+  // Neither chunk was coalesced or unmarked
+  TEST_ASSERT_TRUE(is_in_use(first_chunk));
+  TEST_ASSERT_TRUE(is_prev_mchunk_in_use(second_chunk));
+  int fastbin = fastbin_index(chunk_size);
+  TEST_ASSERT_EQUAL_PTR(second_chunk, get_fastbin_head(&main_arena, fastbin));
+  TEST_ASSERT_EQUAL(2 * chunk_size, main_arena.fastbin_bytes);
+
+  // Last in, first out
+  char *reused_alloc = allocate(sizeof(char) * 32);
+  TEST_ASSERT_EQUAL_PTR(second_alloc, reused_alloc);
+  free_memory(reused_alloc);
+
+  consolidate_fastbins(&main_arena);
+  sort_unsorted_bin(&main_arena, 0);
+  TEST_ASSERT_EQUAL(0, main_arena.fastbin_bytes);
+  int coalesced_bin = find_appropriate_bin(2 * chunk_size);
+  TEST_ASSERT_EQUAL_PTR(first_chunk, main_arena.bins[coalesced_bin]);
+  free_memory(barrier_alloc);
+}
+
+void test_fastbin_needs_no_lock(void) {
+  fastbin_max_size = FASTBIN_MAX_SIZE;
+  char *first_alloc = allocate(sizeof(char) * 32);
+  char *barrier_alloc = allocate(sizeof(char) * 32);
+
+  // Holding the lock would deadlock anything that tried to take it
+  pthread_mutex_lock(&main_arena.lock);
+  free_memory(first_alloc);
+  char *reused_alloc = allocate(sizeof(char) * 32);
+  pthread_mutex_unlock(&main_arena.lock);
+  TEST_ASSERT_EQUAL_PTR(first_alloc, reused_alloc);
+  free_memory(reused_alloc);
+  free_memory(barrier_alloc);
+}
+
+void test_large_request_consolidates_fastbins(void) {
+  fastbin_max_size = FASTBIN_MAX_SIZE;
+  char *small_alloc = allocate(sizeof(char) * 32);
+  char *barrier_alloc = allocate(sizeof(char) * 32);
+  free_memory(small_alloc);
+  TEST_ASSERT_NOT_EQUAL(0, main_arena.fastbin_bytes);
+
+  char *large_alloc = allocate(sizeof(char) * SMALL_SBRK_ALLOCATION);
+  TEST_ASSERT_EQUAL(0, main_arena.fastbin_bytes);
+  TEST_ASSERT_FALSE(is_in_use(payload_into_mchunk(small_alloc)));
+  free_memory(large_alloc);
+  free_memory(barrier_alloc);
+}
+
+unsigned char *shared_allocs[STRESS_SLOTS];
+
+// Every thread keeps a set of live allocations filled with a byte pattern and
+// checks it is intact before freeing
+void *stress_thread(void *seed_ptr) {
+  unsigned int seed = (unsigned int)(uintptr_t)seed_ptr;
+  unsigned char *slots[STRESS_SLOTS] = {NULL};
+  size_t sizes[STRESS_SLOTS] = {0};
+  for (int i = 0; i < STRESS_ITERATIONS; ++i) {
+    int slot = rand_r(&seed) % STRESS_SLOTS;
+    if (slots[slot]) {
+      for (size_t j = 0; j < sizes[slot]; ++j) {
+        if (slots[slot][j] != (unsigned char)slot) {
+          return (void *)1;
+        }
+      }
+      free_memory(slots[slot]);
+    }
+    sizes[slot] = rand_r(&seed) % 2048;
+    slots[slot] = allocate(sizes[slot]);
+    if (!slots[slot]) {
+      return (void *)1;
+    }
+    memset(slots[slot], slot, sizes[slot]);
+  }
+  for (int slot = 0; slot < STRESS_SLOTS; ++slot) {
+    free_memory(slots[slot]);
+  }
+  return NULL;
+}
+
+void test_concurrent_allocations(void) {
+  tcache_count = TCACHE_DEFAULT_COUNT;
+  fastbin_max_size = FASTBIN_MAX_SIZE;
+  slab_max_size = SLAB_MAX_SIZE;
+  pthread_t threads[STRESS_THREADS];
+  for (int i = 0; i < STRESS_THREADS; ++i) {
+    pthread_create(&threads[i], NULL, stress_thread, (void *)(uintptr_t)i);
+  }
+  for (int i = 0; i < STRESS_THREADS; ++i) {
+    void *thread_result;
+    pthread_join(threads[i], &thread_result);
+    TEST_ASSERT_NULL(thread_result);
+  }
+}
+
+// Tiny chunks are handed between threads, so pushes and pops of every
+// fastbin race each other
+void *fastbin_stress_thread(void *seed_ptr) {
+  unsigned int seed = (unsigned int)(uintptr_t)seed_ptr;
+  for (int i = 0; i < STRESS_ITERATIONS; ++i) {
+    size_t size = 1 + rand_r(&seed) % 128;
+    unsigned char *test_alloc = allocate(size);
+    if (!test_alloc) {
+      return (void *)1;
+    }
+    memset(test_alloc, (unsigned char)size, size);
+    test_alloc[0] = size;
+    unsigned char *handed_alloc = __atomic_exchange_n(
+        &shared_allocs[rand_r(&seed) % STRESS_SLOTS], test_alloc,
+        __ATOMIC_ACQ_REL);
+    if (handed_alloc) {
+      for (size_t j = 0; j < handed_alloc[0]; ++j) {
+        if (handed_alloc[j] != handed_alloc[0]) {
+          return (void *)1;
+        }
+      }
+      free_memory(handed_alloc);
+    }
+  }
+  return NULL;
+}
+
+void test_concurrent_fastbin_allocations(void) {
+  fastbin_max_size = FASTBIN_MAX_SIZE;
+  pthread_t threads[STRESS_THREADS];
+  for (int i = 0; i < STRESS_THREADS; ++i) {
+    pthread_create(&threads[i], NULL, fastbin_stress_thread,
+                   (void *)(uintptr_t)i);
+  }
+  for (int i = 0; i < STRESS_THREADS; ++i) {
+    void *thread_result;
+    pthread_join(threads[i], &thread_result);
+    TEST_ASSERT_NULL(thread_result);
+  }
+  for (int slot = 0; slot < STRESS_SLOTS; ++slot) {
+    free_memory(shared_allocs[slot]);
+    shared_allocs[slot] = NULL;
+  }
+}
+
+// Pinned to one CPU, so the thread can't move off the cache it filled
+void test_percpu_cache_reuses_freed_chunk(void) {
+  if (!percpu_cache_available()) {
+    TEST_IGNORE_MESSAGE("No restartable sequences");
+  }
+  cpu_set_t old_cpus, current_cpu;
+  pthread_getaffinity_np(pthread_self(), sizeof(old_cpus), &old_cpus);
+  CPU_ZERO(&current_cpu);
+  CPU_SET(get_current_cpu(), &current_cpu);
+  pthread_setaffinity_np(pthread_self(), sizeof(current_cpu), &current_cpu);
+
+  percpu_cache_count = PERCPU_CACHE_SLOTS;
+  char *first_alloc = allocate(sizeof(char) * TCACHE_ALLOCATION);
+  char *barrier_alloc = allocate(sizeof(char) * 32);
+  free_memory(first_alloc);
+  TEST_ASSERT_TRUE(is_in_use(payload_into_mchunk(first_alloc)));
+  char *second_alloc = allocate(sizeof(char) * TCACHE_ALLOCATION);
+  TEST_ASSERT_EQUAL_PTR(first_alloc, second_alloc);
+
+  free_memory(second_alloc);
+  percpu_cache_count = 0;
+  percpu_cache_flush();
+  size_t chunk_size = get_size(payload_into_mchunk(first_alloc));
+  percpu_cache_count = PERCPU_CACHE_SLOTS;
+  TEST_ASSERT_NULL(percpu_cache_get(chunk_size));
+  percpu_cache_count = 0;
+  free_memory(barrier_alloc);
+  pthread_setaffinity_np(pthread_self(), sizeof(old_cpus), &old_cpus);
+}
+
+void test_concurrent_percpu_cache_allocations(void) {
+  if (!percpu_cache_available()) {
+    TEST_IGNORE_MESSAGE("No restartable sequences");
+  }
+  percpu_cache_count = PERCPU_CACHE_SLOTS;
+  slab_max_size = SLAB_MAX_SIZE;
+  pthread_t threads[STRESS_THREADS];
+  for (int i = 0; i < STRESS_THREADS; ++i) {
+    pthread_create(&threads[i], NULL, fastbin_stress_thread,
+                   (void *)(uintptr_t)i);
+  }
+  for (int i = 0; i < STRESS_THREADS; ++i) {
+    void *thread_result;
+    pthread_join(threads[i], &thread_result);
+    TEST_ASSERT_NULL(thread_result);
+  }
+  for (int slot = 0; slot < STRESS_SLOTS; ++slot) {
+    free_memory(shared_allocs[slot]);
+    shared_allocs[slot] = NULL;
+  }
+  percpu_cache_flush();
+}
+
+void test_slab_packs_small_objects(void) {
+  slab_max_size = SLAB_MAX_SIZE;
+  char *first_alloc = allocate(sizeof(char) * 16);
+  char *second_alloc = allocate(sizeof(char) * 16);
+  char *other_class_alloc = allocate(sizeof(char) * 48);
+  TEST_ASSERT_TRUE(is_slab_object(first_alloc));
+  TEST_ASSERT_TRUE(is_slab_object(other_class_alloc));
+  TEST_ASSERT_EQUAL(16, get_usable_size(first_alloc));
+  TEST_ASSERT_EQUAL(48, get_usable_size(other_class_alloc));
+  // No headers between objects of one class
+  TEST_ASSERT_EQUAL_PTR(first_alloc + 16, second_alloc);
+  TEST_ASSERT_NOT_EQUAL(get_slab_run(first_alloc),
+                        get_slab_run(other_class_alloc));
+
+  free_memory(first_alloc);
+  char *third_alloc = allocate(sizeof(char) * 16);
+  TEST_ASSERT_EQUAL_PTR(first_alloc, third_alloc);
+  // Objects bigger than the slab limit are still heap chunks
+  char *chunk_alloc = allocate(sizeof(char) * SMALL_BIN_ALLOCATION);
+  TEST_ASSERT_FALSE(is_slab_object(chunk_alloc));
+  free_memory(chunk_alloc);
+  free_memory(third_alloc);
+  free_memory(second_alloc);
+  free_memory(other_class_alloc);
+}
+
+void test_empty_slab_run_is_reused(void) {
+  slab_max_size = SLAB_MAX_SIZE;
+  size_t object_size = SLAB_MAX_SIZE;
+  char *objects[2 * SLAB_RUN_SIZE / SLAB_MAX_SIZE];
+  size_t object_count = sizeof(objects) / sizeof(*objects);
+  for (size_t i = 0; i < object_count; ++i) {
+    objects[i] = allocate(sizeof(char) * object_size);
+  }
+  slab_run_t *last_run = get_slab_run(objects[object_count - 1]);
+  TEST_ASSERT_NOT_EQUAL(get_slab_run(objects[0]), last_run);
+  for (size_t i = 0; i < object_count; ++i) {
+    free_memory(objects[i]);
+  }
+
+  // The drained runs went back to the global list, where a class nothing
+  // was allocated from yet picks one up
+  char *other_class_alloc = allocate(sizeof(char) * 128);
+  slab_run_t *reused_run = get_slab_run(other_class_alloc);
+  int is_drained_run = 0;
+  for (size_t i = 0; i < object_count; ++i) {
+    is_drained_run |= reused_run == get_slab_run(objects[i]);
+  }
+  TEST_ASSERT_TRUE(is_drained_run);
+  TEST_ASSERT_EQUAL(128, reused_run->object_size);
+  free_memory(other_class_alloc);
+}
+
+void *free_in_thread(void *payload_ptr) {
+  free_memory(payload_ptr);
+  return NULL;
+}
+
+void test_remote_free_is_queued_on_owner(void) {
+  slab_max_size = SLAB_MAX_SIZE;
+  char *test_alloc = allocate(sizeof(char) * 64);
+  slab_run_t *run = get_slab_run(test_alloc);
+  thread_heap_t *heap = get_thread_heap();
+  TEST_ASSERT_EQUAL_PTR(heap, run->heap);
+  unsigned short free_count = run->free_count;
+
+  // Freeing from another thread takes no lock, not even the arena's
+  pthread_t thread;
+  pthread_mutex_lock(&main_arena.lock);
+  pthread_create(&thread, NULL, free_in_thread, test_alloc);
+  pthread_join(thread, NULL);
+  pthread_mutex_unlock(&main_arena.lock);
+  TEST_ASSERT_EQUAL(free_count, run->free_count);
+  TEST_ASSERT_EQUAL(
+      (uintptr_t)test_alloc | REMOTE_FREES_QUEUED, run->remote_frees);
+  TEST_ASSERT_EQUAL_PTR(run, heap->remote_runs);
+
+  collect_remote_frees(heap);
+  TEST_ASSERT_EQUAL(free_count + 1, run->free_count);
+  TEST_ASSERT_EQUAL(0, run->remote_frees);
+  TEST_ASSERT_NULL(heap->remote_runs);
+}
+
+void *allocate_in_thread(void *unused) {
+  (void)unused;
+  return allocate(sizeof(char) * 64);
+}
+
+void *report_thread_heap(void *unused) {
+  (void)unused;
+  return get_thread_heap();
+}
+
+void test_exited_thread_heap_is_adopted(void) {
+  slab_max_size = SLAB_MAX_SIZE;
+  pthread_t thread;
+  void *test_alloc;
+  pthread_create(&thread, NULL, allocate_in_thread, NULL);
+  pthread_join(thread, &test_alloc);
+  slab_run_t *run = get_slab_run(test_alloc);
+  thread_heap_t *heap = run->heap;
+  TEST_ASSERT_NOT_EQUAL(get_thread_heap(), heap);
+
+  // The run outlives its thread and still takes remote frees
+  free_memory(test_alloc);
+  TEST_ASSERT_EQUAL_PTR(run, heap->remote_runs);
+
+  void *adopted_heap;
+  pthread_create(&thread, NULL, report_thread_heap, NULL);
+  pthread_join(thread, &adopted_heap);
+  TEST_ASSERT_EQUAL_PTR(heap, adopted_heap);
+}
+
+void test_slab_classes_round_requests(void) {
+  slab_max_size = SLAB_MAX_SIZE;
+  for (size_t size = 1; size <= SLAB_MAX_SIZE; ++size) {
+    int slab_class = slab_class_index(calculate_aligned_memory(size));
+    TEST_ASSERT_TRUE(slab_class_sizes[slab_class] >= size);
+    TEST_ASSERT_TRUE(slab_class == 0 ||
+                     slab_class_sizes[slab_class - 1] < size);
+
+    char *slab_alloc = allocate(sizeof(char) * size);
+    TEST_ASSERT_EQUAL(slab_class_sizes[slab_class],
+                      get_usable_size(slab_alloc));
+    free_memory(slab_alloc);
+  }
+}
+
+void test_bins_cover_every_size(void) {
+  // Every bin holds some sizes, in order, up to the unbounded last one
+  int previous_bin = find_appropriate_bin(MIN_CHUNK_SIZE);
+  size_t last_tier_start[] = LARGE_BIN_TIER_START;
+  size_t size = MIN_CHUNK_SIZE + MEM_ALIGNMENT;
+  for (; size <= last_tier_start[LARGE_BIN_TIER_COUNT - 1]; size += 16) {
+    int bin_number = find_appropriate_bin(size);
+    TEST_ASSERT_TRUE(bin_number == previous_bin ||
+                     bin_number == previous_bin + 1);
+    previous_bin = bin_number;
+  }
+  TEST_ASSERT_EQUAL(BIN_COUNT - 1, previous_bin);
+  TEST_ASSERT_EQUAL(BIN_COUNT - 1, find_appropriate_bin(size));
+}
+
+void test_pagemap_knows_owned_memory(void) {
+  slab_max_size = SLAB_MAX_SIZE;
+  char *slab_alloc = allocate(sizeof(char) * 16);
+  char *heap_alloc = allocate(sizeof(char) * SMALL_BIN_ALLOCATION);
+  char *mapped_alloc = allocate(sizeof(char) * MMAP_ALLOCATION);
+  int local_variable;
+
+  uintptr_t slab_owner = lookup_page(slab_alloc);
+  TEST_ASSERT_EQUAL(PAGE_SLAB, get_page_kind(slab_owner));
+  slab_run_t *run = get_page_owner(slab_owner);
+  TEST_ASSERT_EQUAL(16, run->object_size);
+  uintptr_t heap_owner = lookup_page(heap_alloc);
+  TEST_ASSERT_EQUAL(PAGE_HEAP, get_page_kind(heap_owner));
+  TEST_ASSERT_EQUAL_PTR(&main_arena, get_page_owner(heap_owner));
+  char *mapped_end = mapped_alloc + MMAP_ALLOCATION - 1;
+  TEST_ASSERT_EQUAL(PAGE_MMAP, get_page_kind(lookup_page(mapped_alloc)));
+  TEST_ASSERT_EQUAL(PAGE_MMAP, get_page_kind(lookup_page(mapped_end)));
+  TEST_ASSERT_EQUAL(0, lookup_page(&local_variable));
+
+  free_memory(mapped_alloc);
+  TEST_ASSERT_EQUAL(0, lookup_page(mapped_alloc));
+  free_memory(heap_alloc);
+  free_memory(slab_alloc);
+  mmap_threshold = MMAP_THRESHOLD;
+  trim_threshold = DEFAULT_TRIM_THRESHOLD;
+}
+
+void test_free_ignores_foreign_pointers(void) {
+  char foreign_memory[64];
+  memset(foreign_memory, 0xAB, sizeof(foreign_memory));
+  free_memory(foreign_memory + CHUNK_HDR_SIZE);
+  TEST_ASSERT_EQUAL_UINT8(0xAB, foreign_memory[0]);
+}
+
+void test_non_main_arena_allocation(void) {
+  arena_t *arena = add_arena();
+  TEST_ASSERT_NOT_NULL(arena);
+  char *test_alloc = allocate_with_sbrk(arena, calculate_aligned_memory(32));
+  pthread_mutex_unlock(&arena->lock);
+
+  mchunk_t *memory_chunk = payload_into_mchunk(test_alloc);
+  TEST_ASSERT_TRUE(is_in_non_main_arena(memory_chunk));
+  TEST_ASSERT_EQUAL_PTR(arena, chunk_arena(memory_chunk));
+  free_memory(test_alloc);
+  TEST_ASSERT_EQUAL_PTR(arena->top, memory_chunk);
+}
+
+void test_non_main_arena_grows_into_new_heap(void) {
+  arena_t *arena = add_arena();
+  TEST_ASSERT_NOT_NULL(arena);
+  size_t memory_size = calculate_aligned_memory(ARENA_HEAP_ALLOCATION);
+  char *first_alloc = allocate_with_sbrk(arena, memory_size);
+  char *second_alloc = allocate_with_sbrk(arena, memory_size);
+  pthread_mutex_unlock(&arena->lock);
+
+  TEST_ASSERT_NOT_NULL(second_alloc);
+  heap_info_t *first_heap = heap_for_chunk(payload_into_mchunk(first_alloc));
+  heap_info_t *second_heap = heap_for_chunk(payload_into_mchunk(second_alloc));
+  TEST_ASSERT_NOT_EQUAL(first_heap, second_heap);
+  TEST_ASSERT_EQUAL_PTR(first_heap, second_heap->prev);
+  TEST_ASSERT_EQUAL_PTR(arena, chunk_arena(payload_into_mchunk(second_alloc)));
+  free_memory(first_alloc);
+  free_memory(second_alloc);
+}
+
+void *allocate_and_report_arena(void *unused) {
+  (void)unused;
+  char *test_alloc = allocate(sizeof(char) * 32);
+  arena_t *arena = chunk_arena(payload_into_mchunk(test_alloc));
+  free_memory(test_alloc);
+  return arena;
+}
+
+void test_contended_arena_is_avoided(void) {
+  pthread_t thread;
+  void *thread_arena;
+  pthread_mutex_lock(&main_arena.lock);
+  pthread_create(&thread, NULL, allocate_and_report_arena, NULL);
+  pthread_join(thread, &thread_arena);
+  pthread_mutex_unlock(&main_arena.lock);
+  TEST_ASSERT_NOT_EQUAL(&main_arena, thread_arena);
+}
+
+// The ring holds the newest records, the oldest ones get overwritten
+void test_trace_records_calls(void) {
+  char trace_path[] = "/tmp/heap_trace_XXXXXX";
+  int trace_fd = mkstemp(trace_path);
+  TEST_ASSERT_TRUE(trace_fd >= 0);
+  // A ring too big to address is refused rather than mapped short
+  TEST_ASSERT_EQUAL(-1, trace_start(trace_path,
+                                    SIZE_MAX / sizeof(trace_record_t)));
+  TEST_ASSERT_EQUAL(EINVAL, errno);
+  TEST_ASSERT_EQUAL(0, trace_start(trace_path, 4));
+  char *first_alloc = allocate(sizeof(char) * 32);
+  free_memory(first_alloc);
+  char *second_alloc = allocate(sizeof(char) * 64);
+  char *grown_alloc = reallocate(second_alloc, sizeof(char) * 4096);
+  free_memory(grown_alloc);
+  trace_stop();
+  // Untraced once stopped
+  free_memory(allocate(sizeof(char) * 32));
+
+  size_t file_size = sizeof(trace_header_t) + 4 * sizeof(trace_record_t);
+  trace_header_t *header =
+      mmap(NULL, file_size, PROT_READ, MAP_SHARED, trace_fd, 0);
+  TEST_ASSERT_NOT_EQUAL(MAP_FAILED, header);
+  TEST_ASSERT_EQUAL(TRACE_MAGIC, header->magic);
+  TEST_ASSERT_EQUAL(5, header->next_record);
+  trace_record_t *records = get_trace_records(header);
+  TEST_ASSERT_EQUAL(TRACE_FREE, records[0].op);
+  TEST_ASSERT_EQUAL_PTR(grown_alloc, (void *)records[0].pointer);
+  TEST_ASSERT_EQUAL(TRACE_FREE, records[1].op);
+  TEST_ASSERT_EQUAL(TRACE_ALLOCATE, records[2].op);
+  TEST_ASSERT_EQUAL(64, records[2].size);
+  TEST_ASSERT_EQUAL(TRACE_REALLOCATE, records[3].op);
+  TEST_ASSERT_EQUAL_PTR(second_alloc, (void *)records[3].argument);
+  TEST_ASSERT_EQUAL(4096, records[3].size);
+  TEST_ASSERT_EQUAL(records[2].thread, records[3].thread);
+  TEST_ASSERT_TRUE(records[0].timestamp >= records[3].timestamp);
+  munmap(header, file_size);
+  close(trace_fd);
+  unlink(trace_path);
+}
+
+void test_profile_samples_live_allocations(void) {
+  char profile_path[] = "/tmp/heap_profile_XXXXXX";
+  int profile_fd = mkstemp(profile_path);
+  TEST_ASSERT_TRUE(profile_fd >= 0);
+  size_t sample_count = get_sample_count();
+  // With a byte between samples on average, every call after the one
+  // starting the countdown is sampled
+  TEST_ASSERT_EQUAL(0, profile_start(1));
+  free_memory(allocate(sizeof(char) * 100));
+  char *sampled_alloc = allocate(sizeof(char) * 100);
+  profile_stop();
+  TEST_ASSERT_EQUAL(sample_count + 1, get_sample_count());
+  TEST_ASSERT_EQUAL(PAGE_MMAP, get_page_kind(lookup_page(sampled_alloc)));
+
+  TEST_ASSERT_EQUAL(0, profile_write(profile_fd));
+  char profile[256];
+  ssize_t profile_size = pread(profile_fd, profile, sizeof(profile) - 1, 0);
+  TEST_ASSERT_TRUE(profile_size > 0);
+  profile[profile_size] = '\0';
+  TEST_ASSERT_EQUAL_STRING_LEN("heap profile: 1: 100 [1: 100] @ heap_v2/1\n"
+                               "1: 100 [1: 100] @ 0x",
+                               profile, 61);
+
+  sampled_alloc = reallocate(sampled_alloc, sizeof(char) * 8192);
+  TEST_ASSERT_EQUAL(sample_count + 1, get_sample_count());
+  free_memory(sampled_alloc);
+  TEST_ASSERT_EQUAL(sample_count, get_sample_count());
+  close(profile_fd);
+  unlink(profile_path);
+}
+
+// Failing requests neither get sampled nor stall the countdown. The product
+// of this calloc() wraps around to more than PTRDIFF_MAX.
+void test_overflowing_requests_keep_sampling(void) {
+  size_t sample_count = get_sample_count();
+  TEST_ASSERT_EQUAL(0, profile_start(1));
+  free_memory(allocate(sizeof(char) * 100));
+  TEST_ASSERT_NULL(allocate_zeroed(3, SIZE_MAX / 2 + 2));
+  TEST_ASSERT_NULL(allocate(SIZE_MAX));
+  char *sampled_alloc = allocate(sizeof(char) * 100);
+  profile_stop();
+  TEST_ASSERT_EQUAL(sample_count + 1, get_sample_count());
+  free_memory(sampled_alloc);
+}
+
+void test_sample_distances_average_to_the_mean(void) {
+  uint64_t random_state = 0x9e3779b97f4a7c15ull;
+  double sum = 0;
+  for (int i = 0; i < 100000; ++i) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    sum += exponential_variate(random_state * 0x2545f4914f6cdd1dull);
+  }
+  double mean = sum / 100000;
+  TEST_ASSERT_TRUE(mean > 0.98 && mean < 1.02);
+}
+
+void test_stats_follow_bins_and_top(void) {
+  char *test_alloc = allocate(200);
+  char *barrier_alloc = allocate(32);
+  mchunk_t *memory_chunk = payload_into_mchunk(test_alloc);
+  int bin_number = find_appropriate_bin(get_size(memory_chunk));
+  allocator_stats_t before;
+  allocator_stats(&before);
+  free_memory(test_alloc);
+  allocator_stats_t after;
+  allocator_stats(&after);
+  TEST_ASSERT_EQUAL(before.bin_free_bytes[bin_number] + get_size(memory_chunk),
+                    after.bin_free_bytes[bin_number]);
+  TEST_ASSERT_EQUAL(before.free_chunk_count + 1, after.free_chunk_count);
+  TEST_ASSERT_EQUAL(before.in_use_bytes - get_size(memory_chunk),
+                    after.in_use_bytes);
+  TEST_ASSERT_EQUAL(main_arena.heap_bytes, after.sbrk_bytes);
+  TEST_ASSERT_GREATER_OR_EQUAL(get_size(main_arena.top), after.top_bytes);
+  TEST_ASSERT_GREATER_OR_EQUAL(after.sbrk_bytes, after.peak_sbrk_bytes);
+  free_memory(barrier_alloc);
+}
+
+void test_stats_count_chunks(void) {
+  fastbin_max_size = FASTBIN_MAX_SIZE;
+  char *fast_alloc = allocate(32);
+  char *binned_alloc = allocate(200);
+  char *barrier_alloc = allocate(32);
+  allocator_stats_t before;
+  allocator_stats(&before);
+  free_memory(fast_alloc);
+  free_memory(binned_alloc);
+  allocator_stats_t after;
+  allocator_stats(&after);
+  TEST_ASSERT_EQUAL(before.free_chunk_count + 2, after.free_chunk_count);
+  TEST_ASSERT_EQUAL(before.in_use_chunk_count - 2, after.in_use_chunk_count);
+  free_memory(barrier_alloc);
+  fastbin_max_size = 0;
+}
+
+void test_stats_count_mapped_chunks(void) {
+  allocator_stats_t before;
+  allocator_stats(&before);
+  char *test_alloc = allocate(4 * MMAP_THRESHOLD);
+  allocator_stats_t during;
+  allocator_stats(&during);
+  TEST_ASSERT_EQUAL(before.mmap_chunk_count + 1, during.mmap_chunk_count);
+  TEST_ASSERT_EQUAL(before.in_use_chunk_count + 1, during.in_use_chunk_count);
+  TEST_ASSERT_GREATER_OR_EQUAL(before.mmap_bytes + 4 * MMAP_THRESHOLD,
+                               during.mmap_bytes);
+  TEST_ASSERT_GREATER_OR_EQUAL(during.mmap_bytes, during.peak_mmap_bytes);
+  TEST_ASSERT_GREATER_OR_EQUAL(during.system_bytes, during.peak_system_bytes);
+  free_memory(test_alloc);
+  allocator_stats_t after;
+  allocator_stats(&after);
+  TEST_ASSERT_EQUAL(before.mmap_bytes, after.mmap_bytes);
+  TEST_ASSERT_EQUAL(before.in_use_bytes, after.in_use_bytes);
+}
+
+void test_child_allocates_after_fork(void) {
+  pthread_atfork(prepare_fork, release_fork_locks_in_parent,
+                 release_fork_locks_in_child);
+  pid_t child = fork();
+  if (child == 0) {
+    char *memory = allocate(sizeof(char) * SMALL_BIN_ALLOCATION);
+    free_memory(memory);
+    _exit(memory ? 0 : 1);
+  }
+  int status;
+  waitpid(child, &status, 0);
+  TEST_ASSERT_TRUE(WIFEXITED(status));
+  TEST_ASSERT_EQUAL(0, WEXITSTATUS(status));
+  // The parent gets its locks back
+  TEST_ASSERT_EQUAL(0, pthread_mutex_trylock(&main_arena.lock));
+  pthread_mutex_unlock(&main_arena.lock);
+}
+
+void test_heap_continues_after_foreign_sbrk(void) {
+  char *first_alloc = allocate(sizeof(char) * 32);
+  // Move the program break behind the allocators back, like libc's malloc
+  // does, so the top can't grow in place anymore
+  void *foreign_memory = sbrk(HEAP_PAGE);
+  TEST_ASSERT_NOT_EQUAL(SBRK_ERR, foreign_memory);
+
+  // Ask for more than the top or any chunk left over by the earlier tests
+  // holds, from the heap rather than mmap()
+  size_t big_size = get_size(main_arena.top) + TRIM_ALLOCATION;
+  mmap_threshold = MMAP_THRESHOLD_MAX;
+  char *big_alloc = allocate(sizeof(char) * big_size);
+  TEST_ASSERT_NOT_NULL(big_alloc);
+  TEST_ASSERT_FALSE(is_chunk_mmaped(payload_into_mchunk(big_alloc)));
+  TEST_ASSERT_TRUE((char *)big_alloc > (char *)foreign_memory);
+  memset(big_alloc, 0xCD, big_size);
+  free_memory(big_alloc);
+  free_memory(first_alloc);
+  mmap_threshold = MMAP_THRESHOLD;
+}
+
+typedef struct walked_chunks_t {
+  mchunk_t *wanted;
+  int found_wanted;
+  int found_top;
+  size_t main_heap_bytes;
+} walked_chunks_t;
+
+static void record_walked_chunk(arena_t *arena, mchunk_t *memory_chunk,
+                                void *context) {
+  walked_chunks_t *walked = context;
+  if (arena != &main_arena) {
+    return;
+  }
+  walked->found_wanted |= memory_chunk == walked->wanted;
+  walked->found_top |= memory_chunk == main_arena.top;
+  walked->main_heap_bytes += get_size(memory_chunk);
+}
+
+// Runs after the program break moved behind our back, so the walk has to
+// cross from the current heap to the one before
+void test_heap_walk_visits_every_heap(void) {
+  char *test_alloc = allocate(200);
+  walked_chunks_t walked = {payload_into_mchunk(test_alloc), 0, 0, 0};
+  heap_walk(record_walked_chunk, &walked);
+  TEST_ASSERT_TRUE(walked.found_wanted);
+  TEST_ASSERT_TRUE(walked.found_top);
+  TEST_ASSERT_TRUE(walked.main_heap_bytes <= main_arena.heap_bytes);
+
+  heap_analysis_t analysis;
+  analyze_heap(&analysis);
+  TEST_ASSERT_GREATER_OR_EQUAL(2, analysis.heap_count);
+  free_memory(test_alloc);
+}
+
+void test_heap_analysis_finds_free_chunks(void) {
+  char *first_alloc = allocate(200);
+  char *first_barrier = allocate(32);
+  char *second_alloc = allocate(1000);
+  char *second_barrier = allocate(32);
+  heap_analysis_t before;
+  analyze_heap(&before);
+  free_memory(first_alloc);
+  free_memory(second_alloc);
+  heap_analysis_t after;
+  analyze_heap(&after);
+
+  size_t first_size = get_size(payload_into_mchunk(first_alloc));
+  size_t second_size = get_size(payload_into_mchunk(second_alloc));
+  TEST_ASSERT_EQUAL(before.free_chunk_count + 2, after.free_chunk_count);
+  TEST_ASSERT_EQUAL(before.free_bytes + first_size + second_size,
+                    after.free_bytes);
+  TEST_ASSERT_EQUAL(before.in_use_bytes - first_size - second_size,
+                    after.in_use_bytes);
+  TEST_ASSERT_GREATER_OR_EQUAL(second_size, after.largest_free_chunk);
+  int bucket = 8 * sizeof(size_t) - 1 - __builtin_clzl(first_size);
+  TEST_ASSERT_EQUAL(before.size_histogram[bucket] + 1,
+                    after.size_histogram[bucket]);
+  int bin_number = find_appropriate_bin(second_size);
+  TEST_ASSERT_EQUAL(before.bin_free_bytes[bin_number] + second_size,
+                    after.bin_free_bytes[bin_number]);
+  TEST_ASSERT_TRUE(after.fragmentation > 0 && after.fragmentation < 1);
+  free_memory(first_barrier);
+  free_memory(second_barrier);
+}
+
+void test_heap_analysis_leaves_fastbins(void) {
+  fastbin_max_size = FASTBIN_MAX_SIZE;
+  char *first_alloc = allocate(32);
+  char *second_alloc = allocate(32);
+  char *barrier_alloc = allocate(32);
+  mchunk_t *second_chunk = payload_into_mchunk(second_alloc);
+  size_t chunk_size = get_size(second_chunk);
+  heap_analysis_t before;
+  analyze_heap(&before);
+  free_memory(first_alloc);
+  free_memory(second_alloc);
+  heap_analysis_t after;
+  analyze_heap(&after);
+
+  TEST_ASSERT_EQUAL(before.free_chunk_count + 2, after.free_chunk_count);
+  TEST_ASSERT_EQUAL(before.free_bytes + 2 * chunk_size, after.free_bytes);
+  TEST_ASSERT_EQUAL(before.in_use_chunk_count - 2, after.in_use_chunk_count);
+  int bin_number = find_appropriate_bin(chunk_size);
+  TEST_ASSERT_EQUAL(before.bin_chunk_count[bin_number] + 2,
+                    after.bin_chunk_count[bin_number]);
+  // Nothing was coalesced, the fastbin is as it was
+  TEST_ASSERT_TRUE(is_in_use(second_chunk));
+  int fastbin = fastbin_index(chunk_size);
+  TEST_ASSERT_EQUAL_PTR(second_chunk, get_fastbin_head(&main_arena, fastbin));
+  TEST_ASSERT_EQUAL_PTR(payload_into_mchunk(first_alloc),
+                        second_chunk->fd_chunk);
+  TEST_ASSERT_EQUAL(2 * chunk_size, main_arena.fastbin_bytes);
+  free_memory(barrier_alloc);
+  fastbin_max_size = 0;
 }
 
 int main(void) {
+  // Unbuffered output keeps libc's malloc from moving the program break
+  // between the tests that look at the heap layout
+  setvbuf(stdout, NULL, _IONBF, 0);
   UNITY_BEGIN();
   RUN_TEST(test_is_memory_released_on_top);
   RUN_TEST(test_is_memory_released_on_bin);
@@ -98,6 +1288,58 @@ int main(void) {
   RUN_TEST(test_big_sbrk_allocation_freeing);
   RUN_TEST(test_coalesce_two_small_chunks);
   RUN_TEST(test_coalesce_three_small_chunks);
+  RUN_TEST(test_remove_from_middle_of_bin);
+  RUN_TEST(test_exact_fit_skips_sorting);
+  RUN_TEST(test_bin_boundaries);
   RUN_TEST(test_allocate_zero_bytes);
+  RUN_TEST(test_binmap_follows_bins);
+  RUN_TEST(test_allocation_splits_bigger_chunk);
+  RUN_TEST(test_mmap_allocation);
+  RUN_TEST(test_mmap_threshold_rises_after_free);
+  RUN_TEST(test_set_thresholds_stay_after_free);
+  RUN_TEST(test_top_is_trimmed_after_free);
+  RUN_TEST(test_allocator_trim_releases_top);
+  RUN_TEST(test_large_free_chunk_pages_are_released);
+  RUN_TEST(test_release_waits_for_threshold);
+  RUN_TEST(test_allocate_zeroed);
+  RUN_TEST(test_allocate_zeroed_skips_fresh_memory);
+  RUN_TEST(test_reallocate_grows_into_top);
+  RUN_TEST(test_reallocate_grows_into_free_chunk);
+  RUN_TEST(test_reallocate_moves_data);
+  RUN_TEST(test_reallocate_shrinks_in_place);
+  RUN_TEST(test_reallocate_remaps_mmap_chunk);
+  RUN_TEST(test_allocate_aligned);
+  RUN_TEST(test_tcache_reuses_freed_chunk);
+  RUN_TEST(test_tcache_flushes_half_when_full);
+  RUN_TEST(test_fastbin_defers_coalescing);
+  RUN_TEST(test_fastbin_needs_no_lock);
+  RUN_TEST(test_large_request_consolidates_fastbins);
+  RUN_TEST(test_slab_packs_small_objects);
+  RUN_TEST(test_empty_slab_run_is_reused);
+  RUN_TEST(test_remote_free_is_queued_on_owner);
+  RUN_TEST(test_exited_thread_heap_is_adopted);
+  RUN_TEST(test_slab_classes_round_requests);
+  RUN_TEST(test_bins_cover_every_size);
+  RUN_TEST(test_pagemap_knows_owned_memory);
+  RUN_TEST(test_free_ignores_foreign_pointers);
+  RUN_TEST(test_non_main_arena_allocation);
+  RUN_TEST(test_non_main_arena_grows_into_new_heap);
+  RUN_TEST(test_contended_arena_is_avoided);
+  RUN_TEST(test_concurrent_allocations);
+  RUN_TEST(test_concurrent_fastbin_allocations);
+  RUN_TEST(test_percpu_cache_reuses_freed_chunk);
+  RUN_TEST(test_concurrent_percpu_cache_allocations);
+  RUN_TEST(test_trace_records_calls);
+  RUN_TEST(test_profile_samples_live_allocations);
+  RUN_TEST(test_overflowing_requests_keep_sampling);
+  RUN_TEST(test_sample_distances_average_to_the_mean);
+  RUN_TEST(test_stats_follow_bins_and_top);
+  RUN_TEST(test_stats_count_chunks);
+  RUN_TEST(test_stats_count_mapped_chunks);
+  RUN_TEST(test_heap_analysis_finds_free_chunks);
+  RUN_TEST(test_heap_analysis_leaves_fastbins);
+  RUN_TEST(test_child_allocates_after_fork);
+  RUN_TEST(test_heap_continues_after_foreign_sbrk);
+  RUN_TEST(test_heap_walk_visits_every_heap);
   return UNITY_END();
 }
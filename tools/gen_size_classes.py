@@ -0,0 +1,206 @@
+#!/usr/bin/env python3
+"""Generates src/size_classes.h, the bin layout and the slab size classes.
+
+The defaults reproduce the dlmalloc style layout the allocator was tuned
+with. Fewer classes per doubling and a looser fragmentation bound give fewer,
+wider classes, which fill runs faster and keep fewer partially used runs
+around at the cost of more internal fragmentation per object.
+
+    tools/gen_size_classes.py --classes-per-doubling 4 \
+        --max-fragmentation 0.2 > src/size_classes.h
+"""
+
+import argparse
+import sys
+
+MEM_ALIGNMENT = 16
+CHUNK_HDR_SIZE = 16
+SLAB_RUN_SIZE = 4096
+PAGE_SIZE = 4096
+LARGE_BIN_TIERS = "64x32,512x16,4096x8,32768x3"
+
+
+def floor_pow2(value):
+    return 1 << (value.bit_length() - 1)
+
+
+def ceil_pow2(value):
+    return 1 << (value - 1).bit_length()
+
+
+def parse_tiers(text):
+    tiers = []
+    for tier in text.split(","):
+        spacing, count = (int(field) for field in tier.split("x"))
+        if spacing < MEM_ALIGNMENT or spacing & (spacing - 1) or count < 1:
+            sys.exit("bad tier %r: spacing must be a power of two >= %d"
+                     % (tier, MEM_ALIGNMENT))
+        tiers.append((spacing, count))
+    return tiers
+
+
+def geometric_tiers(small_bin_max, bins_per_doubling, large_bin_max):
+    """One tier per power of two, each split into bins_per_doubling bins."""
+    tiers = []
+    tier_start = small_bin_max
+    while tier_start < large_bin_max:
+        spacing = max(MEM_ALIGNMENT,
+                      ceil_pow2(tier_start + MEM_ALIGNMENT)
+                      // bins_per_doubling)
+        tiers.append((spacing, bins_per_doubling))
+        tier_start += spacing * bins_per_doubling
+    return tiers
+
+
+def slab_classes(classes_per_doubling, max_fragmentation, slab_max_size):
+    """Each class is as far above the previous one as both bounds allow.
+
+    The spacing is at most a 1/classes_per_doubling share of the power of two
+    the class is in, and at most max_fragmentation of the class size, so a
+    request just above a class wastes no more than that in the next one. The
+    spacing never drops below the alignment, which bounds the smallest classes
+    instead.
+    """
+    sizes = [MEM_ALIGNMENT]
+    while sizes[-1] < slab_max_size:
+        size = sizes[-1]
+        spacing = min(floor_pow2(size) // classes_per_doubling,
+                      int(size * max_fragmentation))
+        spacing = max(MEM_ALIGNMENT, spacing // MEM_ALIGNMENT * MEM_ALIGNMENT)
+        sizes.append(min(size + spacing, slab_max_size))
+    return sizes
+
+
+def format_table(values, indent="    "):
+    lines = []
+    line = indent
+    for value in values:
+        item = "%d, " % value
+        if len(line) + len(item) > 78:
+            lines.append(line.rstrip())
+            line = indent
+        line += item
+    lines.append(line.rstrip().rstrip(","))
+    return "{ \\\n" + " \\\n".join(lines) + "}"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--classes-per-doubling", type=int, default=16,
+                        help="slab classes per power of two (default 16)")
+    parser.add_argument("--max-fragmentation", type=float, default=0.25,
+                        help="largest share of a slab object a request may "
+                             "leave unused (default 0.25)")
+    parser.add_argument("--slab-max-size", type=int, default=256,
+                        help="largest slab object (default 256)")
+    parser.add_argument("--small-bin-max", type=int, default=1008,
+                        help="largest chunk with an exact fit bin "
+                             "(default 1008)")
+    parser.add_argument("--large-bin-tiers", default=LARGE_BIN_TIERS,
+                        help="SPACINGxCOUNT list of the large bin tiers "
+                             "(default %s)" % LARGE_BIN_TIERS)
+    parser.add_argument("--bins-per-doubling", type=int, default=0,
+                        help="split every power of two above the small bins "
+                             "into this many bins instead of using tiers")
+    parser.add_argument("--large-bin-max", type=int, default=32 << 20,
+                        help="where geometric bins stop (default 32 MiB)")
+    args = parser.parse_args()
+
+    if args.classes_per_doubling < 1 or args.max_fragmentation <= 0:
+        sys.exit("classes per doubling and fragmentation must be positive")
+    if (args.slab_max_size % MEM_ALIGNMENT or
+            not MEM_ALIGNMENT <= args.slab_max_size <= SLAB_RUN_SIZE // 16):
+        sys.exit("slab max size must be a multiple of %d up to %d"
+                 % (MEM_ALIGNMENT, SLAB_RUN_SIZE // 16))
+    if (args.small_bin_max % MEM_ALIGNMENT or
+            args.small_bin_max < args.slab_max_size + CHUNK_HDR_SIZE):
+        sys.exit("small bin max must be a multiple of %d covering the slab "
+                 "classes" % MEM_ALIGNMENT)
+    if args.bins_per_doubling:
+        count = args.bins_per_doubling
+        if count & (count - 1):
+            sys.exit("bins per doubling must be a power of two")
+        tiers = geometric_tiers(args.small_bin_max, count, args.large_bin_max)
+    else:
+        tiers = parse_tiers(args.large_bin_tiers)
+
+    out = []
+    out.append(" ".join(["// Generated by tools/gen_size_classes.py"] +
+                        sys.argv[1:]))
+    out.append("// Do not edit, rerun the generator instead")
+    out.append("#ifndef SIZE_CLASSES_H")
+    out.append("#define SIZE_CLASSES_H")
+    out.append("")
+
+    small_bin_count = args.small_bin_max // MEM_ALIGNMENT
+    layout = ["bins[0] = N/A", "bins[1] = unsorted bin",
+              "bins[2-%d] = small bins(ranging from 32 to %d bytes)"
+              % (small_bin_count, args.small_bin_max)]
+    tier_start = [args.small_bin_max]
+    tier_first_bin = [small_bin_count]
+    tier_shift = []
+    for spacing, count in tiers:
+        first_bin = tier_first_bin[-1] + 1
+        layout.append("bins[%d-%d] = large bins with %d byte spacing"
+                      % (first_bin, first_bin + count - 1, spacing))
+        tier_shift.append(spacing.bit_length() - 1)
+        tier_start.append(tier_start[-1] + spacing * count)
+        tier_first_bin.append(tier_first_bin[-1] + count)
+    # The last bin of the last tier also takes everything above it
+    bin_count = tier_first_bin[-1] + 1
+    tier_first_bin[-1] = bin_count - 2
+    tier_shift.append(63)
+    last_tier = layout.pop()
+    if tiers[-1][1] > 1:
+        layout.append(last_tier.replace("-%d]" % (bin_count - 1),
+                                        "-%d]" % (bin_count - 2)))
+    layout.append("bins[%d] = whats left" % (bin_count - 1))
+
+    out.append("/*")
+    out.extend(" * " + line for line in layout)
+    out.append(" */")
+    out.append("#define BIN_COUNT %d" % bin_count)
+    out.append("#define SMALL_BIN_MAX %d" % args.small_bin_max)
+    for (spacing, _), tier_max in zip(tiers, tier_start[1:]):
+        out.append("#define LARGE_BIN_%d_BYTE_SPACING_MAX %d"
+                   % (spacing, tier_max))
+    out.append("")
+    out.append("// Spacing tiers of the large bins, the last one holds "
+               "everything above them")
+    out.append("#define LARGE_BIN_TIER_COUNT %d" % len(tier_start))
+    out.append("#define LARGE_BIN_TIER_START %s" % format_table(tier_start))
+    out.append("#define LARGE_BIN_TIER_FIRST_BIN %s"
+               % format_table(tier_first_bin))
+    out.append("#define LARGE_BIN_TIER_SHIFT %s" % format_table(tier_shift))
+    # Release starts with the first tier whose bins are a page apart, smaller
+    # chunks rarely span a whole page
+    release_min_size = next(
+        (start + MEM_ALIGNMENT for (spacing, _), start
+         in zip(tiers, tier_start) if spacing >= PAGE_SIZE),
+        tier_start[-1] + MEM_ALIGNMENT)
+    out.append("// Pages of free chunks from this size up get released to the "
+               "kernel")
+    out.append("#define RELEASE_MIN_SIZE %du" % release_min_size)
+    out.append("")
+
+    sizes = slab_classes(args.classes_per_doubling, args.max_fragmentation,
+                         args.slab_max_size)
+    lookup = []
+    for object_size in range(MEM_ALIGNMENT, args.slab_max_size + 1,
+                             MEM_ALIGNMENT):
+        lookup.append(next(index for index, size in enumerate(sizes)
+                           if size >= object_size))
+    out.append("// Slab object sizes, for requests up to %d bytes"
+               % args.slab_max_size)
+    out.append("#define SLAB_MAX_SIZE %d" % args.slab_max_size)
+    out.append("#define SLAB_CLASS_COUNT %d" % len(sizes))
+    out.append("#define SLAB_CLASS_SIZES %s" % format_table(sizes))
+    out.append("// Class of every object size, in steps of the alignment")
+    out.append("#define SLAB_CLASS_LOOKUP %s" % format_table(lookup))
+    out.append("")
+    out.append("#endif")
+    print("\n".join(out))
+
+
+if __name__ == "__main__":
+    main()